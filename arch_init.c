@@ -110,6 +110,18 @@ static int is_dup_page(uint8_t *page, uint8_t ch)
 static RAMBlock *last_block;
 static ram_addr_t last_offset;
 
+/* Pages of TLM RAMs live in the main emulator and get moved through
+   this buffer with debug accesses.  */
+static uint8_t tlm_page[TARGET_PAGE_SIZE];
+
+static void tlm_page_write(RAMBlock *block, void *host, uint8_t *buf)
+{
+    uint64_t addr = block->TLM.base + ((uint8_t *) host - block->host);
+
+    block->TLM.bus_access_dbg(block->TLM.opaque, -1, 1, addr,
+                              buf, TARGET_PAGE_SIZE);
+}
+
 static int ram_save_block(QEMUFile *f)
 {
     RAMBlock *block = last_block;
@@ -132,6 +144,12 @@ static int ram_save_block(QEMUFile *f)
                                             MIGRATION_DIRTY_FLAG);
 
             p = block->host + offset;
+            if (block->TLM.opaque) {
+                block->TLM.bus_access_dbg(block->TLM.opaque, -1, 0,
+                                          block->TLM.base + offset,
+                                          tlm_page, TARGET_PAGE_SIZE);
+                p = tlm_page;
+            }
 
             if (is_dup_page(p, *p)) {
                 qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_COMPRESS);
@@ -337,7 +355,8 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 
 static inline void *host_from_stream_offset(QEMUFile *f,
                                             ram_addr_t offset,
-                                            int flags)
+                                            int flags,
+                                            RAMBlock **pblock)
 {
     static RAMBlock *block = NULL;
     char id[256];
@@ -349,6 +368,7 @@ static inline void *host_from_stream_offset(QEMUFile *f,
             return NULL;
         }
 
+        *pblock = block;
         return block->host + offset;
     }
 
@@ -357,8 +377,10 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     id[len] = 0;
 
     QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            *pblock = block;
             return block->host + offset;
+        }
     }
 
     fprintf(stderr, "Can't find block %s!\n", id);
@@ -420,34 +442,48 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
 
         if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            RAMBlock *block = NULL;
             void *host;
             uint8_t ch;
 
             if (version_id == 3)
                 host = qemu_get_ram_ptr(addr);
             else
-                host = host_from_stream_offset(f, addr, flags);
+                host = host_from_stream_offset(f, addr, flags, &block);
             if (!host) {
                 return -EINVAL;
             }
 
             ch = qemu_get_byte(f);
-            memset(host, ch, TARGET_PAGE_SIZE);
+            if (block && block->TLM.opaque) {
+                memset(tlm_page, ch, TARGET_PAGE_SIZE);
+                tlm_page_write(block, host, tlm_page);
+            } else {
+                memset(host, ch, TARGET_PAGE_SIZE);
 #ifndef _WIN32
-            if (ch == 0 &&
-                (!kvm_enabled() || kvm_has_sync_mmu())) {
-                qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
-            }
+                /* Memory handed to us may be a shared mapping.  */
+                if (ch == 0 &&
+                    !(block && (block->flags & RAM_PREALLOC_MASK)) &&
+                    (!kvm_enabled() || kvm_has_sync_mmu())) {
+                    qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+                }
 #endif
+            }
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
+            RAMBlock *block = NULL;
             void *host;
 
             if (version_id == 3)
                 host = qemu_get_ram_ptr(addr);
             else
-                host = host_from_stream_offset(f, addr, flags);
+                host = host_from_stream_offset(f, addr, flags, &block);
 
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            if (block && block->TLM.opaque) {
+                qemu_get_buffer(f, tlm_page, TARGET_PAGE_SIZE);
+                tlm_page_write(block, host, tlm_page);
+            } else {
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            }
         }
         if (qemu_file_has_error(f)) {
             return -EIO;
@@ -35,6 +35,7 @@ typedef unsigned long ram_addr_t;
 
 typedef struct TLM_RAMBlock {
     int iodev;
+    void *tlm_dev;    /* The TLM device backing the block.  */
     void *opaque;
     uint64_t base;
     int (*bus_access)(void *opaque, int64_t clk, int rw,
@@ -105,6 +106,8 @@ void cpu_unregister_io_memory(int table_address);
 
 int cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                             int len, int is_write);
+int cpu_physical_memory_rw_burst(target_phys_addr_t addr, uint8_t *buf,
+                                 int len, int is_write);
 void cpu_physical_memory_rw_debug(target_phys_addr_t addr, uint8_t *buf,
                             int len, int is_write);
 static inline void cpu_physical_memory_read(target_phys_addr_t addr,
@@ -21,6 +21,7 @@
 #include "disas.h"
 #include "tcg.h"
 #include "qemu-barrier.h"
+#include "tlm.h"
 
 int tb_invalidated_flag;
 
@@ -101,6 +102,7 @@ static TranslationBlock *tb_find_slow(CPUState *env,
         tb = *ptb1;
         if (!tb)
             goto not_found;
+        tlm_stats.tb_hash_probes++;
         if (tb->pc == pc &&
             tb->page_addr[0] == phys_page1 &&
             tb->cs_base == cs_base &&
@@ -121,6 +123,9 @@ static TranslationBlock *tb_find_slow(CPUState *env,
  not_found:
    /* if no translated code available, then translate it now */
     tb = tb_gen_code(env, pc, cs_base, flags, 0);
+    /* Already at the head of its chain, which may have moved with a
+       grow of the hash table.  */
+    goto cache;
 
  found:
     /* Move the last found TB to the head of the list */
@@ -129,8 +134,10 @@ static TranslationBlock *tb_find_slow(CPUState *env,
         tb->phys_hash_next = tb_phys_hash[h];
         tb_phys_hash[h] = tb;
     }
+
+ cache:
     /* we add the TB in the virtual pc hash table */
-    env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    env->tb_jmp_cache[tb_jmp_cache_hash_func(env, pc)] = tb;
     return tb;
 }
 
@@ -144,9 +151,11 @@ static inline TranslationBlock *tb_find_fast(CPUState *env)
        always be the same before a given translated block
        is executed. */
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(env, pc)];
+    tlm_stats.jmp_cache_lookups++;
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
+        tlm_stats.jmp_cache_misses++;
         tb = tb_find_slow(env, pc, cs_base, flags);
     }
     return tb;
@@ -1043,12 +1043,21 @@ static int tcg_cpu_exec(CPUState *env)
     ti = profile_getclock();
 #endif
     if (use_icount) {
+        CPUState *penv;
         int64_t count;
         int decr;
+        int left = 0;
+
         qemu_icount -= (env->icount_decr.u16.low + env->icount_extra);
         env->icount_decr.u16.low = 0;
         env->icount_extra = 0;
         count = qemu_icount_round(qemu_next_icount_deadline());
+        /* Share what is left up to the deadline with the cores that
+           still run in this round, or the first one takes it all.  */
+        for (penv = env; penv; penv = penv->next_cpu) {
+            left++;
+        }
+        count = (count + left - 1) / left;
         qemu_icount += count;
         decr = (count > 0xffff) ? 0xffff : count;
         count -= decr;
@@ -1097,6 +1106,10 @@ bool cpu_exec_all(void)
                 qemu_kvm_eat_signals(env);
             } else {
                 r = tcg_cpu_exec(env);
+                tlm_stats.tb_exits++;
+                if (tlm_irq_pending) {
+                    tlm_irq_flush();
+                }
             }
             if (r == EXCP_DEBUG) {
                 cpu_handle_guest_debug(env);
@@ -1107,6 +1120,7 @@ bool cpu_exec_all(void)
         }
     }
     if (tlm_sync) {
+        tlm_stats.syncs++;
         tlm_sync(tlm_opaque, qemu_get_clock_ns(vm_clock));
     }
     exit_request = 0;
@@ -106,8 +106,9 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
+/* Initial and largest size of tb_phys_hash.  */
 #define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+#define CODE_GEN_PHYS_HASH_MAX_BITS 22
 
 #define MIN_CODE_GEN_BUFFER_SIZE     (1024 * 1024)
 
@@ -130,9 +131,11 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_TLM_PROF    0x10000 /* Counts its executions, see tlm_prof.  */
+#define CF_TLM_TRACE   0x20000 /* Calls tlm_trace_tb at each execution.  */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
@@ -157,35 +160,70 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* Executions, bumped by the translated code when profiling.  */
+    uint64_t prof_count;
 };
 
-static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
+/* Only the bottom half of the jump cache hash bits vary for addresses
+   on the same page.  The top bits are the same.  This allows TLB
+   invalidation to quickly clear a subset of the hash table, see
+   tb_jmp_page_size.  */
+static inline unsigned int tb_jmp_page_bits(CPUState *env)
 {
+    return env->tb_jmp_cache_bits / 2;
+}
+
+static inline unsigned int tb_jmp_page_size(CPUState *env)
+{
+    return 1 << tb_jmp_page_bits(env);
+}
+
+static inline unsigned int tb_jmp_cache_size(CPUState *env)
+{
+    return 1 << env->tb_jmp_cache_bits;
+}
+
+static inline unsigned int tb_jmp_cache_hash_page(CPUState *env,
+                                                  target_ulong pc)
+{
+    unsigned int shift = TARGET_PAGE_BITS - tb_jmp_page_bits(env);
     target_ulong tmp;
-    tmp = pc ^ (pc >> (TARGET_PAGE_BITS - TB_JMP_PAGE_BITS));
-    return (tmp >> (TARGET_PAGE_BITS - TB_JMP_PAGE_BITS)) & TB_JMP_PAGE_MASK;
+    tmp = pc ^ (pc >> shift);
+    return (tmp >> shift)
+           & (tb_jmp_cache_size(env) - tb_jmp_page_size(env));
 }
 
-static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
+static inline unsigned int tb_jmp_cache_hash_func(CPUState *env,
+                                                  target_ulong pc)
 {
+    unsigned int shift = TARGET_PAGE_BITS - tb_jmp_page_bits(env);
     target_ulong tmp;
-    tmp = pc ^ (pc >> (TARGET_PAGE_BITS - TB_JMP_PAGE_BITS));
-    return (((tmp >> (TARGET_PAGE_BITS - TB_JMP_PAGE_BITS)) & TB_JMP_PAGE_MASK)
-	    | (tmp & TB_JMP_ADDR_MASK));
+    tmp = pc ^ (pc >> shift);
+    return ((tmp >> shift)
+            & (tb_jmp_cache_size(env) - tb_jmp_page_size(env)))
+           | (tmp & (tb_jmp_page_size(env) - 1));
 }
 
+extern unsigned int tb_phys_hash_bits;
+
+/* Multiplicative hash, takes the top bits of the product so that all
+   bits of pc contribute.  */
 static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    return ((uint64_t)pc * 0x9e3779b97f4a7c15ULL) >> (64 - tb_phys_hash_bits);
 }
 
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUState *env);
+extern uint64_t *gen_tb_prof_counter;
+extern TranslationBlock *gen_tb_trace;
+void tlm_trace_tb(void *tb);
+uint64_t tlm_trace_icount(CPUState *env);
 void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
-extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+extern TranslationBlock **tb_phys_hash;
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -306,7 +344,16 @@ static inline tb_page_addr_t get_page_addr_code(CPUState *env1, target_ulong add
     return addr;
 }
 #else
-int tlm_iodev_is_ram(int iodev);
+extern RAMBlock *tlm_iodev_ram_block[IO_MEM_NB_ENTRIES];
+/* Used by the softmmu when doing IO to tell TLM RAMs from other devices.  */
+static inline int tlm_iodev_is_ram(int iodev)
+{
+    return tlm_iodev_ram_block[iodev] != NULL;
+}
+void *tlm_dmi_tlb_ptr(void *dev, uint64_t addr, uint64_t len, int write);
+int tlm_iodev_burst(int io_index, uint64_t addr, void *buf, int len,
+                    int is_write);
+void tlm_ram_written(void *dev, uint64_t addr, int len);
 /* NOTE: this function can trigger an exception */
 /* NOTE2: the returned address is not exactly the physical address: it
    is the offset relative to phys_ram_base */
@@ -330,14 +377,12 @@ static inline tb_page_addr_t get_page_addr_code(CPUState *env1, target_ulong add
          paddr >>= IO_MEM_SHIFT;
          paddr &= (IO_MEM_NB_ENTRIES - 1);
          if (mmio && tlm_iodev_is_ram(paddr)) {
-             RAMBlock *block;
-             QLIST_FOREACH(block, &ram_list.blocks, next){
-                 if(paddr == (block->TLM.iodev >> IO_MEM_SHIFT)){
-                     return block->offset + (uintptr_t)(addr) + env1->tlb_table[mmu_idx][page_index].addend - (uintptr_t)(block->host);
-                 }
-             }
-             fprintf(stderr, "Bad ram pointer %llx\n", (unsigned long long)addr);
-             abort();
+             RAMBlock *block = tlm_iodev_ram_block[paddr];
+
+             /* The addend may point into a DMI area, use the
+                iotlb offset into the block instead.  */
+             paddr = env1->iotlb[mmu_idx][page_index] + addr;
+             return block->offset + paddr - block->TLM.iodev;
          } else {
              cpu_abort(env1, "Trying to execute code outside RAM or ROM at 0x"
                               TARGET_FMT_lx "\n", addr);
@@ -35,6 +35,7 @@
 #include "qemu-timer.h"
 #include "memory.h"
 #include "exec-memory.h"
+#include "tlm.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -78,7 +79,9 @@
 
 static TranslationBlock *tbs;
 static int code_gen_max_blocks;
-TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+/* Grows with the number of TBs, see tb_phys_hash_grow.  */
+TranslationBlock **tb_phys_hash;
+unsigned int tb_phys_hash_bits;
 static int nb_tbs;
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
@@ -102,6 +105,8 @@ spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 uint8_t code_gen_prologue[1024] code_gen_section;
 static uint8_t *code_gen_buffer;
 static unsigned long code_gen_buffer_size;
+/* Part of the buffer in use, it can grow up to code_gen_buffer_size.  */
+static unsigned long code_gen_buffer_limit;
 /* threshold to flush the translated code buffer */
 static unsigned long code_gen_buffer_max_size;
 static uint8_t *code_gen_ptr;
@@ -466,12 +471,23 @@ static uint8_t static_code_gen_buffer[DEFAULT_CODE_GEN_BUFFER_SIZE]
                __attribute__((aligned (CODE_GEN_ALIGN)));
 #endif
 
+/* Let the translated code use limit bytes of the buffer.  */
+static void code_gen_set_limit(unsigned long limit)
+{
+    code_gen_buffer_limit = limit;
+    code_gen_buffer_max_size = limit - (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
+    code_gen_max_blocks = limit / CODE_GEN_AVG_BLOCK_SIZE;
+}
+
 static void code_gen_alloc(unsigned long tb_size)
 {
+    unsigned long limit;
+
 #ifdef USE_STATIC_CODE_GEN_BUFFER
     code_gen_buffer = static_code_gen_buffer;
     code_gen_buffer_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
     map_exec(code_gen_buffer, code_gen_buffer_size);
+    limit = code_gen_buffer_size;
 #else
     code_gen_buffer_size = tb_size;
     if (code_gen_buffer_size == 0) {
@@ -479,12 +495,24 @@ static void code_gen_alloc(unsigned long tb_size)
         /* in user mode, phys_ram_size is not meaningful */
         code_gen_buffer_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
 #else
-        /* XXX: needs adjustments */
-        code_gen_buffer_size = (unsigned long)(ram_size / 4);
+        /* TLMu memory lives outside of QEMU, so ram_size says nothing
+           about the code size.  */
+        if (tlm_tb_size) {
+            code_gen_buffer_size = tlm_tb_size;
+        } else {
+            /* XXX: needs adjustments */
+            code_gen_buffer_size = (unsigned long)(ram_size / 4);
+        }
 #endif
     }
     if (code_gen_buffer_size < MIN_CODE_GEN_BUFFER_SIZE)
         code_gen_buffer_size = MIN_CODE_GEN_BUFFER_SIZE;
+    limit = code_gen_buffer_size;
+    /* Map the whole size the buffer may grow to. Pages only get
+       allocated once translated code reaches them.  */
+    if (tlm_tb_size_max > code_gen_buffer_size) {
+        code_gen_buffer_size = tlm_tb_size_max;
+    }
     /* The code gen buffer location may have constraints depending on
        the host cpu and OS */
 #if defined(__linux__) 
@@ -493,6 +521,9 @@ static void code_gen_alloc(unsigned long tb_size)
         void *start = NULL;
 
         flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        if (code_gen_buffer_size > limit) {
+            flags |= MAP_NORESERVE;
+        }
 #if defined(__x86_64__)
         flags |= MAP_32BIT;
         /* Cannot map more than that */
@@ -521,6 +552,15 @@ static void code_gen_alloc(unsigned long tb_size)
         code_gen_buffer = mmap(start, code_gen_buffer_size,
                                PROT_WRITE | PROT_READ | PROT_EXEC,
                                flags, -1, 0);
+#if defined(__x86_64__)
+        /* Many large buffers don't fit below 2GB. Jumps out of the
+           buffer fall back to indirect ones when out of range.  */
+        if (code_gen_buffer == MAP_FAILED) {
+            code_gen_buffer = mmap(start, code_gen_buffer_size,
+                                   PROT_WRITE | PROT_READ | PROT_EXEC,
+                                   flags & ~MAP_32BIT, -1, 0);
+        }
+#endif
         if (code_gen_buffer == MAP_FAILED) {
             fprintf(stderr, "Could not allocate dynamic translator buffer\n");
             exit(1);
@@ -563,10 +603,13 @@ static void code_gen_alloc(unsigned long tb_size)
 #endif
 #endif /* !USE_STATIC_CODE_GEN_BUFFER */
     map_exec(code_gen_prologue, sizeof(code_gen_prologue));
-    code_gen_buffer_max_size = code_gen_buffer_size -
-        (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
-    code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
-    tbs = g_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+    /* TBs never move, so room for all of them is allocated up front.  */
+    tbs = g_malloc(code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE
+                   * sizeof(TranslationBlock));
+    if (limit > code_gen_buffer_size) {
+        limit = code_gen_buffer_size;
+    }
+    code_gen_set_limit(limit);
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -576,6 +619,8 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
+    tb_phys_hash_bits = CODE_GEN_PHYS_HASH_BITS;
+    tb_phys_hash = g_malloc0(sizeof(*tb_phys_hash) << tb_phys_hash_bits);
     code_gen_ptr = code_gen_buffer;
     page_init();
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
@@ -656,6 +701,15 @@ void cpu_exec_init(CPUState *env)
     }
     env->cpu_index = cpu_index;
     env->numa_node = 0;
+    /* Half of the hash bits index within a page, see
+       tb_jmp_cache_hash_page.  */
+    env->tb_jmp_cache_bits = tlm_jmp_cache_bits ? tlm_jmp_cache_bits
+                                                : TB_JMP_CACHE_BITS;
+    if (env->tb_jmp_cache_bits > 2 * TARGET_PAGE_BITS) {
+        env->tb_jmp_cache_bits = 2 * TARGET_PAGE_BITS;
+    }
+    env->tb_jmp_cache = g_malloc0(sizeof(*env->tb_jmp_cache)
+                                  << env->tb_jmp_cache_bits);
     QTAILQ_INIT(&env->breakpoints);
     QTAILQ_INIT(&env->watchpoints);
 #ifndef CONFIG_USER_ONLY
@@ -684,11 +738,177 @@ static TranslationBlock *tb_alloc(target_ulong pc)
     tb = &tbs[nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+    tb->prof_count = 0;
     return tb;
 }
 
+/*
+ * TB execution profile. The translated code counts executions per TB,
+ * the counts get folded into a table of guest code ranges before the
+ * TBs go away.
+ */
+static struct tlmu_prof_entry *tlm_prof_tab;
+static unsigned int tlm_prof_tab_size;
+static unsigned int nr_tlm_prof;
+
+static struct tlmu_prof_entry *tlm_prof_find(uint64_t pc, uint32_t size)
+{
+    unsigned int h = (pc ^ (pc >> 12) ^ size) & (tlm_prof_tab_size - 1);
+
+    while (tlm_prof_tab[h].count) {
+        if (tlm_prof_tab[h].pc == pc && tlm_prof_tab[h].size == size) {
+            break;
+        }
+        h = (h + 1) & (tlm_prof_tab_size - 1);
+    }
+    return &tlm_prof_tab[h];
+}
+
+static void tlm_prof_grow(void)
+{
+    struct tlmu_prof_entry *old = tlm_prof_tab;
+    unsigned int old_size = tlm_prof_tab_size;
+    unsigned int i;
+
+    tlm_prof_tab_size = old_size ? old_size * 2 : 1024;
+    tlm_prof_tab = g_malloc0(tlm_prof_tab_size * sizeof *tlm_prof_tab);
+    for (i = 0; i < old_size; i++) {
+        if (old[i].count) {
+            *tlm_prof_find(old[i].pc, old[i].size) = old[i];
+        }
+    }
+    g_free(old);
+}
+
+static void tlm_prof_fold(TranslationBlock *tb)
+{
+    struct tlmu_prof_entry *e;
+
+    if (!tb->prof_count) {
+        return;
+    }
+    if (nr_tlm_prof * 2 >= tlm_prof_tab_size) {
+        tlm_prof_grow();
+    }
+
+    e = tlm_prof_find(tb->pc, tb->size);
+    if (!e->count) {
+        e->pc = tb->pc;
+        e->size = tb->size;
+        e->insns = tb->icount;
+        nr_tlm_prof++;
+    }
+    e->count += tb->prof_count;
+    e->icount += tb->prof_count * tb->icount;
+    tb->prof_count = 0;
+}
+
+static int tlm_prof_cmp(const void *a, const void *b)
+{
+    const struct tlmu_prof_entry *ea = a, *eb = b;
+
+    if (ea->pc != eb->pc) {
+        return ea->pc < eb->pc ? -1 : 1;
+    }
+    return ea->size - eb->size;
+}
+
+/* Write the profile collected so far to filename. Returns 0 on success.  */
+int tlm_prof_dump(const char *filename)
+{
+    struct tlmu_prof_entry *entries;
+    uint32_t hdr[2];
+    unsigned int i, n;
+    FILE *fp;
+    int r = 0;
+
+    for (i = 0; i < nb_tbs; i++) {
+        tlm_prof_fold(&tbs[i]);
+    }
+
+    entries = g_malloc0((nr_tlm_prof + 1) * sizeof *entries);
+    for (i = 0, n = 0; i < tlm_prof_tab_size; i++) {
+        if (tlm_prof_tab[i].count) {
+            entries[n++] = tlm_prof_tab[i];
+        }
+    }
+    qsort(entries, n, sizeof *entries, tlm_prof_cmp);
+
+    fp = fopen(filename, "wb");
+    if (!fp) {
+        perror(filename);
+        g_free(entries);
+        return -1;
+    }
+    hdr[0] = TLMU_PROF_VERSION;
+    hdr[1] = n;
+    if (fwrite(TLMU_PROF_MAGIC, 8, 1, fp) != 1
+        || fwrite(hdr, sizeof hdr, 1, fp) != 1
+        || (n && fwrite(entries, sizeof *entries, n, fp) != n)) {
+        perror(filename);
+        r = -1;
+    }
+    if (fclose(fp)) {
+        r = -1;
+    }
+    g_free(entries);
+    return r;
+}
+
+/* Mark the guest code of a new TB as covered.  */
+static void tlm_cov_mark(TranslationBlock *tb)
+{
+    uint64_t start, end, i;
+
+    if (!tlm_cov.bitmap || !tb->size
+        || tb->pc < tlm_cov.base
+        || tb->pc - tlm_cov.base >= tlm_cov.size) {
+        return;
+    }
+
+    start = (tb->pc - tlm_cov.base) >> tlm_cov.granule_shift;
+    end = (tb->pc + tb->size - 1 - tlm_cov.base);
+    if (end >= tlm_cov.size) {
+        end = tlm_cov.size - 1;
+    }
+    end >>= tlm_cov.granule_shift;
+
+    /* The bitmap may be shared by instances on other threads.  */
+    for (i = start; i <= end; i++) {
+        __sync_fetch_and_or(&tlm_cov.bitmap[i / 8], 1 << (i % 8));
+    }
+}
+
+/* Timestamp for trace records, see struct tlmu_trace_rec.  */
+uint64_t tlm_trace_icount(CPUState *env)
+{
+    if (!use_icount || !env) {
+        return tlm_trace.icount;
+    }
+    return qemu_icount - (env->icount_decr.u16.low + env->icount_extra);
+}
+
+/* Called at the start of each traced TB execution, see gen-icount.h.  */
+void tlm_trace_tb(void *opaque)
+{
+    TranslationBlock *tb = opaque;
+    CPUState *env = cpu_single_env;
+
+    /* Blocks translated while tracing outlive tlmu_trace_stop, see
+       tlm_trace_put.  */
+    if (!tlm_trace.recs) {
+        return;
+    }
+    /* The icount check at the TB start has already accounted for it.  */
+    tlm_trace_put(TLMU_TRACE_TB, env->cpu_index,
+                  tlm_trace_icount(env) - (use_icount ? tb->icount : 0),
+                  tb->pc, tb->icount);
+    tlm_trace.icount += tb->icount;
+}
+
 void tb_free(TranslationBlock *tb)
 {
+    tlm_prof_fold(tb);
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
@@ -743,6 +963,7 @@ static void page_flush_tb(void)
 void tb_flush(CPUState *env1)
 {
     CPUState *env;
+    int i;
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
            (unsigned long)(code_gen_ptr - code_gen_buffer),
@@ -752,19 +973,24 @@ void tb_flush(CPUState *env1)
     if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
 
+    for (i = 0; i < nb_tbs; i++) {
+        tlm_prof_fold(&tbs[i]);
+    }
     nb_tbs = 0;
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
-        memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+        memset (env->tb_jmp_cache, 0,
+                tb_jmp_cache_size(env) * sizeof (void *));
     }
 
-    memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
+    memset (tb_phys_hash, 0, (sizeof (void *)) << tb_phys_hash_bits);
     page_flush_tb();
 
     code_gen_ptr = code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tb_flush_count++;
+    tlm_stats.tb_flushes++;
 }
 
 #ifdef DEBUG_TB_CHECK
@@ -774,7 +1000,7 @@ static void tb_invalidate_check(target_ulong address)
     TranslationBlock *tb;
     int i;
     address &= TARGET_PAGE_MASK;
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
+    for(i = 0;i < (1 << tb_phys_hash_bits); i++) {
         for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
             if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
                   address >= tb->pc + tb->size)) {
@@ -792,7 +1018,7 @@ static void tb_page_check(void)
     TranslationBlock *tb;
     int i, flags1, flags2;
 
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
+    for(i = 0;i < (1 << tb_phys_hash_bits); i++) {
         for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
             flags1 = page_get_flags(tb->pc);
             flags2 = page_get_flags(tb->pc + tb->size - 1);
@@ -902,8 +1128,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb_invalidated_flag = 1;
 
     /* remove the TB from the hash list */
-    h = tb_jmp_cache_hash_func(tb->pc);
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
+        h = tb_jmp_cache_hash_func(env, tb->pc);
         if (env->tb_jmp_cache[h] == tb)
             env->tb_jmp_cache[h] = NULL;
     }
@@ -993,9 +1219,18 @@ TranslationBlock *tb_gen_code(CPUState *env,
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
     int code_gen_size;
+    int64_t t0;
 
+    t0 = get_clock();
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
+    if (!tb && code_gen_buffer_limit < code_gen_buffer_size) {
+        /* Grow in place, the existing TBs stay valid.  */
+        code_gen_set_limit(MIN(code_gen_buffer_limit * 2,
+                               code_gen_buffer_size));
+        tlm_stats.tb_grows++;
+        tb = tb_alloc(pc);
+    }
     if (!tb) {
         /* flush must be done */
         tb_flush(env);
@@ -1004,12 +1239,24 @@ TranslationBlock *tb_gen_code(CPUState *env,
         /* Don't forget to invalidate previous TB info.  */
         tb_invalidated_flag = 1;
     }
+    tlm_stats.tbs_translated++;
     tc_ptr = code_gen_ptr;
     tb->tc_ptr = tc_ptr;
     tb->cs_base = cs_base;
     tb->flags = flags;
+    /* Retranslations must generate the same code, so they go by these
+       rather than by the current settings.  */
+    if (tlm_prof) {
+        cflags |= CF_TLM_PROF;
+    }
+    if (tlm_trace.recs && tlm_trace.exec) {
+        cflags |= CF_TLM_TRACE;
+    }
     tb->cflags = cflags;
     cpu_gen_code(env, tb, &code_gen_size);
+    tlm_stats.translate_ns += get_clock() - t0;
+    tlm_stats.translated_bytes += code_gen_size;
+    tlm_cov_mark(tb);
     code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
     /* check next page if needed */
@@ -1278,6 +1525,30 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 #endif /* TARGET_HAS_SMC */
 }
 
+/* Double the physical hash table, to keep the chains short as the number
+   of TBs grows. The chains lose their most recently used order.  */
+static void tb_phys_hash_grow(void)
+{
+    TranslationBlock **old = tb_phys_hash;
+    TranslationBlock *tb, *next;
+    unsigned int i, h;
+
+    tb_phys_hash = g_malloc0(sizeof(*tb_phys_hash)
+                             << (tb_phys_hash_bits + 1));
+    tb_phys_hash_bits++;
+    for (i = 0; i < (1 << (tb_phys_hash_bits - 1)); i++) {
+        for (tb = old[i]; tb != NULL; tb = next) {
+            next = tb->phys_hash_next;
+            h = tb_phys_hash_func(tb->page_addr[0]
+                                  + (tb->pc & ~TARGET_PAGE_MASK));
+            tb->phys_hash_next = tb_phys_hash[h];
+            tb_phys_hash[h] = tb;
+        }
+    }
+    g_free(old);
+    tlm_stats.tb_hash_grows++;
+}
+
 /* add a new TB and link it to the physical page tables. phys_page2 is
    (-1) to indicate that only one page contains the TB. */
 void tb_link_page(TranslationBlock *tb,
@@ -1289,6 +1560,10 @@ void tb_link_page(TranslationBlock *tb,
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
+    if (nb_tbs > (1 << tb_phys_hash_bits)
+        && tb_phys_hash_bits < CODE_GEN_PHYS_HASH_MAX_BITS) {
+        tb_phys_hash_grow();
+    }
     /* add in the physical hash table */
     h = tb_phys_hash_func(phys_pc);
     ptb = &tb_phys_hash[h];
@@ -1939,6 +2214,7 @@ CPUState *cpu_copy(CPUState *env)
     CPUState *new_env = cpu_init(env->cpu_model_str);
     CPUState *next_cpu = new_env->next_cpu;
     int cpu_index = new_env->cpu_index;
+    TranslationBlock **tb_jmp_cache = new_env->tb_jmp_cache;
 #if defined(TARGET_HAS_ICE)
     CPUBreakpoint *bp;
     CPUWatchpoint *wp;
@@ -1946,9 +2222,10 @@ CPUState *cpu_copy(CPUState *env)
 
     memcpy(new_env, env, sizeof(CPUState));
 
-    /* Preserve chaining and index. */
+    /* Preserve chaining, index and jump cache. */
     new_env->next_cpu = next_cpu;
     new_env->cpu_index = cpu_index;
+    new_env->tb_jmp_cache = tb_jmp_cache;
 
     /* Clone all break/watchpoints.
        Note: Once we support ptrace with hw-debug register access, make sure
@@ -1976,13 +2253,13 @@ static inline void tlb_flush_jmp_cache(CPUState *env, target_ulong addr)
 
     /* Discard jump cache entries for any tb which might potentially
        overlap the flushed page.  */
-    i = tb_jmp_cache_hash_page(addr - TARGET_PAGE_SIZE);
+    i = tb_jmp_cache_hash_page(env, addr - TARGET_PAGE_SIZE);
     memset (&env->tb_jmp_cache[i], 0, 
-            TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
+            tb_jmp_page_size(env) * sizeof(TranslationBlock *));
 
-    i = tb_jmp_cache_hash_page(addr);
+    i = tb_jmp_cache_hash_page(env, addr);
     memset (&env->tb_jmp_cache[i], 0, 
-            TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
+            tb_jmp_page_size(env) * sizeof(TranslationBlock *));
 }
 
 static CPUTLBEntry s_cputlb_empty_entry = {
@@ -2012,7 +2289,7 @@ void tlb_flush(CPUState *env, int flush_global)
         }
     }
 
-    memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+    memset (env->tb_jmp_cache, 0, tb_jmp_cache_size(env) * sizeof (void *));
 
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
@@ -2090,13 +2367,29 @@ static inline void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry,
     }
 }
 
+/* Re-arm dirty tracking in all TLBs for entries pointing into the host
+   range start1 - start1 + length - 1.  */
+static void tlb_reset_dirty_all(unsigned long start1, unsigned long length)
+{
+    CPUState *env;
+    int i;
+
+    for(env = first_cpu; env != NULL; env = env->next_cpu) {
+        int mmu_idx;
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            for(i = 0; i < CPU_TLB_SIZE; i++)
+                tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
+                                      start1, length);
+        }
+    }
+}
+
 /* Note: start and end must be within the same ram block.  */
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags)
 {
-    CPUState *env;
-    unsigned long length, start1;
-    int i;
+    unsigned long length, start1, off, host, run, run_len;
+    TLM_RAMBlock *tlm_rb;
 
     start &= TARGET_PAGE_MASK;
     end = TARGET_PAGE_ALIGN(end);
@@ -2116,13 +2409,32 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
         abort();
     }
 
-    for(env = first_cpu; env != NULL; env = env->next_cpu) {
-        int mmu_idx;
-        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-            for(i = 0; i < CPU_TLB_SIZE; i++)
-                tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
-                                      start1, length);
+    tlb_reset_dirty_all(start1, length);
+
+    /* TLM RAMs may have TLB entries pointing into DMI areas rather than
+       into the block. The block's host pointer is the physical address.
+       tlb_set_page maps DMI per page, so look the pages up one by one
+       and re-arm runs that are contiguous on the host.  */
+    tlm_rb = qemu_get_ram_tlmblock(start);
+    if (!tlm_rb) {
+        return;
+    }
+    run = run_len = 0;
+    for (off = 0; off < length; off += TARGET_PAGE_SIZE) {
+        host = (unsigned long)tlm_dmi_tlb_ptr(tlm_rb->tlm_dev, start1 + off,
+                                              TARGET_PAGE_SIZE, 1);
+        if (run_len && host == run + run_len) {
+            run_len += TARGET_PAGE_SIZE;
+            continue;
+        }
+        if (run_len) {
+            tlb_reset_dirty_all(run, run_len);
         }
+        run = host;
+        run_len = host ? TARGET_PAGE_SIZE : 0;
+    }
+    if (run_len) {
+        tlb_reset_dirty_all(run, run_len);
     }
 }
 
@@ -2305,6 +2617,8 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     CPUWatchpoint *wp;
     target_phys_addr_t iotlb;
     TLM_RAMBlock *tlm_rb = NULL;
+    void *dmi_host = NULL;
+    int dmi_write = 0;
 
     assert(size >= TARGET_PAGE_SIZE);
     if (size != TARGET_PAGE_SIZE) {
@@ -2354,6 +2668,18 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     if (tlm_rb) {
         address |= TLB_MMIO;
         iotlb = tlm_rb->iodev + paddr - tlm_rb->base;
+
+        /* If the TLM RAM has granted DMI for this page, let data accesses
+           go directly to the DMI area. Code fetches and the accesses
+           that need dirty tracking still go through the TLM device.  */
+        dmi_host = tlm_dmi_tlb_ptr(tlm_rb->tlm_dev, paddr & TARGET_PAGE_MASK,
+                                   TARGET_PAGE_SIZE, 0);
+        if (dmi_host) {
+            addend = (unsigned long)dmi_host;
+            dmi_write = tlm_dmi_tlb_ptr(tlm_rb->tlm_dev,
+                                        paddr & TARGET_PAGE_MASK,
+                                        TARGET_PAGE_SIZE, 1) == dmi_host;
+        }
     }
     code_address = address;
     /* Make accesses to pages with watchpoints go via the
@@ -2364,6 +2690,7 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
             if ((prot & PAGE_WRITE) || (wp->flags & BP_MEM_READ)) {
                 iotlb = io_mem_watch + paddr;
                 address |= TLB_MMIO;
+                dmi_host = NULL;
                 break;
             }
         }
@@ -2374,7 +2701,7 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     te = &env->tlb_table[mmu_idx][index];
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
-        te->addr_read = address;
+        te->addr_read = dmi_host ? address & ~TLB_MMIO : address;
     } else {
         te->addr_read = -1;
     }
@@ -2389,6 +2716,10 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
             (pd & IO_MEM_ROMD)) {
             /* Write access calls the I/O callback.  */
             te->addr_write = address | TLB_MMIO;
+        } else if (dmi_host && dmi_write &&
+                   cpu_physical_memory_is_dirty(pd)) {
+            /* No code on the page, write directly to the DMI area.  */
+            te->addr_write = address & ~TLB_MMIO;
         } else if ((pd & ~TARGET_PAGE_MASK) == IO_MEM_RAM &&
                    !cpu_physical_memory_is_dirty(pd)) {
             te->addr_write = address | TLB_NOTDIRTY;
@@ -2963,6 +3294,81 @@ static ram_addr_t last_ram_offset(void)
     return last;
 }
 
+/* RAMBlocks sorted by offset, for binary searches by ram address.  */
+static RAMBlock **ram_block_index;
+static int nr_ram_block_index;
+/* Last block found by ram_block_lookup.  */
+static RAMBlock *ram_block_mru;
+
+/* TLM RAMBlocks indexed by the IO memory index of their TLM device.  */
+RAMBlock *tlm_iodev_ram_block[IO_MEM_NB_ENTRIES];
+
+static void ram_block_index_add(RAMBlock *new_block)
+{
+    int i;
+
+    ram_block_index = g_realloc(ram_block_index, (nr_ram_block_index + 1)
+                                                 * sizeof *ram_block_index);
+    for (i = nr_ram_block_index;
+         i > 0 && ram_block_index[i - 1]->offset > new_block->offset; i--) {
+        ram_block_index[i] = ram_block_index[i - 1];
+    }
+    ram_block_index[i] = new_block;
+    nr_ram_block_index++;
+
+    if (new_block->TLM.opaque) {
+        tlm_iodev_ram_block[new_block->TLM.iodev >> IO_MEM_SHIFT] = new_block;
+    }
+}
+
+static void ram_block_index_remove(RAMBlock *block)
+{
+    int i;
+
+    for (i = 0; i < nr_ram_block_index; i++) {
+        if (ram_block_index[i] == block) {
+            nr_ram_block_index--;
+            memmove(&ram_block_index[i], &ram_block_index[i + 1],
+                    (nr_ram_block_index - i) * sizeof *ram_block_index);
+            break;
+        }
+    }
+    if (ram_block_mru == block) {
+        ram_block_mru = NULL;
+    }
+    if (block->TLM.opaque
+        && tlm_iodev_ram_block[block->TLM.iodev >> IO_MEM_SHIFT] == block) {
+        tlm_iodev_ram_block[block->TLM.iodev >> IO_MEM_SHIFT] = NULL;
+    }
+}
+
+/* Find the block holding addr without reordering ram_list.  */
+static RAMBlock *ram_block_lookup(ram_addr_t addr)
+{
+    RAMBlock *block = ram_block_mru;
+    int lo, hi, mid;
+
+    if (block && addr - block->offset < block->length) {
+        return block;
+    }
+
+    lo = 0;
+    hi = nr_ram_block_index;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        block = ram_block_index[mid];
+        if (addr < block->offset) {
+            hi = mid;
+        } else if (addr - block->offset >= block->length) {
+            lo = mid + 1;
+        } else {
+            ram_block_mru = block;
+            return block;
+        }
+    }
+    return NULL;
+}
+
 ram_addr_t qemu_ram_alloc_from_ptr_2(DeviceState *dev, const char *name,
                                    ram_addr_t size, void *host,
                                    TLM_RAMBlock *tlm_rb)
@@ -3035,6 +3441,7 @@ ram_addr_t qemu_ram_alloc_from_ptr_2(DeviceState *dev, const char *name,
     new_block->length = size;
 
     QLIST_INSERT_HEAD(&ram_list.blocks, new_block, next);
+    ram_block_index_add(new_block);
 
     ram_list.phys_dirty = g_realloc(ram_list.phys_dirty,
                                        last_ram_offset() >> TARGET_PAGE_BITS);
@@ -3064,6 +3471,7 @@ void qemu_ram_free_from_ptr(ram_addr_t addr)
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QLIST_REMOVE(block, next);
+            ram_block_index_remove(block);
             g_free(block);
             return;
         }
@@ -3077,6 +3485,7 @@ void qemu_ram_free(ram_addr_t addr)
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QLIST_REMOVE(block, next);
+            ram_block_index_remove(block);
             if (block->flags & RAM_PREALLOC_MASK) {
                 ;
             } else if (mem_path) {
@@ -3233,18 +3642,10 @@ void *qemu_get_ram_base_ptr(ram_addr_t addr)
 
 TLM_RAMBlock *qemu_get_ram_tlmblock(ram_addr_t addr)
 {
-    RAMBlock *block;
+    RAMBlock *block = ram_block_lookup(addr);
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (addr - block->offset < block->length) {
-            QLIST_REMOVE(block, next);
-            QLIST_INSERT_HEAD(&ram_list.blocks, block, next);
-            if (block->TLM.opaque) {
-                return &block->TLM;
-            } else {
-                return NULL;
-            }
-        }
+    if (block) {
+        return block->TLM.opaque ? &block->TLM : NULL;
     }
 
     fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
@@ -3553,7 +3954,7 @@ void notdirty_mem_wr(target_phys_addr_t addr, int len)
         /* invalidate code */
         tb_invalidate_phys_page_range(ramaddr, ramaddr + len, 0);
         /* set dirty bit */
-        cpu_physical_memory_set_dirty_flags(addr,
+        cpu_physical_memory_set_dirty_flags(ramaddr,
            (0xff & ~CODE_DIRTY_FLAG));
     }
 }
@@ -4063,8 +4464,81 @@ int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
 }
 
 #else
+/* Extend an access of l bytes at addr for as long as the following pages
+   map the same memory region, but never beyond len bytes. RAM bursts
+   stay within one RAMBlock, blocks allocated back to back have
+   contiguous offsets but may belong to different TLM devices.  */
+static int phys_burst_len(target_phys_addr_t addr, int l, int len,
+                          PhysPageDesc *p)
+{
+    target_phys_addr_t page = addr & TARGET_PAGE_MASK;
+    ram_addr_t pd, region_offset, ram_end = 0;
+    PhysPageDesc *np;
+    RAMBlock *block;
+    int is_io;
+
+    if (!p) {
+        return l;
+    }
+    pd = p->phys_offset;
+    region_offset = p->region_offset;
+    is_io = (pd & ~TARGET_PAGE_MASK) > IO_MEM_ROM && !(pd & IO_MEM_ROMD);
+    if (!is_io) {
+        block = ram_block_lookup(pd & TARGET_PAGE_MASK);
+        if (!block) {
+            return l;
+        }
+        ram_end = block->offset + block->length;
+    }
+
+    while (l < len) {
+        page += TARGET_PAGE_SIZE;
+        /* RAM pages advance phys_offset, IO pages the region_offset.  */
+        if (is_io) {
+            region_offset += TARGET_PAGE_SIZE;
+        } else {
+            pd += TARGET_PAGE_SIZE;
+            if ((pd & TARGET_PAGE_MASK) >= ram_end) {
+                break;
+            }
+        }
+        np = phys_page_find(page >> TARGET_PAGE_BITS);
+        if (!np || np->phys_offset != pd
+            || (is_io && np->region_offset != region_offset)) {
+            break;
+        }
+        l += MIN(len - l, TARGET_PAGE_SIZE);
+    }
+    return l;
+}
+
+/* Update the dirty flags and invalidate any code in a written RAM range.  */
+static void phys_ram_written(ram_addr_t addr1, int l)
+{
+    ram_addr_t end = addr1 + l;
+    ram_addr_t next;
+
+    while (addr1 < end) {
+        next = (addr1 & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+        if (next > end) {
+            next = end;
+        }
+        if (!cpu_physical_memory_is_dirty(addr1)) {
+            /* invalidate code */
+            tb_invalidate_phys_page_range(addr1, next, 0);
+            /* set dirty bit */
+            cpu_physical_memory_set_dirty_flags(
+                addr1, (0xff & ~CODE_DIRTY_FLAG));
+        }
+        addr1 = next;
+    }
+}
+
+/* In burst mode, accesses to TLM RAMs make a single bus access per
+   contiguous area and IO devices that support it get a single call per
+   contiguous region.  */
 static int cpu_physical_memory_rw1(target_phys_addr_t addr, uint8_t *buf,
-                            int len, int is_write, int is_debug)
+                            int len, int is_write, int is_debug, int is_burst)
 {
     int l, io_index;
     uint8_t *ptr;
@@ -4090,12 +4564,20 @@ static int cpu_physical_memory_rw1(target_phys_addr_t addr, uint8_t *buf,
         if (is_write) {
             if ((pd & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
                 target_phys_addr_t addr1 = addr;
+                int bl = 0;
+
                 io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
                 if (p)
                     addr1 = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+                if (is_burst) {
+                    bl = tlm_iodev_burst(io_index, addr1, buf,
+                                         phys_burst_len(addr, l, len, p), 1);
+                }
                 /* XXX: could force cpu_single_env to NULL to avoid
                    potential bugs */
-                if (l >= 4 && ((addr1 & 3) == 0)) {
+                if (bl > 0) {
+                    l = bl;
+                } else if (l >= 4 && ((addr1 & 3) == 0)) {
                     /* 32 bit write access */
                     val = ldl_p(buf);
                     io_mem_write[io_index][2](io_mem_opaque[io_index], addr1, val);
@@ -4119,33 +4601,39 @@ static int cpu_physical_memory_rw1(target_phys_addr_t addr, uint8_t *buf,
                 tl = qemu_get_ram_tlmblock(addr1);
                 is_ram = 1;
                 if (tl) {
+                    if (is_burst) {
+                        l = phys_burst_len(addr, l, len, p);
+                    }
                     if (is_debug) {
                         tl->bus_access_dbg(tl->opaque, -1, 1, addr,
                                              (void *) buf, l);
                     } else {
                         tl->bus_access(tl->opaque, -1, 1, addr, (void *) buf, l);
                     }
+                    tlm_ram_written(tl->tlm_dev, addr, l);
                 } else {
                     memcpy(ptr, buf, l);
                 }
-                if (!cpu_physical_memory_is_dirty(addr1)) {
-                    /* invalidate code */
-                    tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
-                    /* set dirty bit */
-                    cpu_physical_memory_set_dirty_flags(
-                        addr1, (0xff & ~CODE_DIRTY_FLAG));
-                }
+                phys_ram_written(addr1, l);
                 qemu_put_ram_ptr(ptr);
             }
         } else {
             if ((pd & ~TARGET_PAGE_MASK) > IO_MEM_ROM &&
                 !(pd & IO_MEM_ROMD)) {
                 target_phys_addr_t addr1 = addr;
+                int bl = 0;
+
                 /* I/O case */
                 io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
                 if (p)
                     addr1 = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
-                if (l >= 4 && ((addr1 & 3) == 0)) {
+                if (is_burst) {
+                    bl = tlm_iodev_burst(io_index, addr1, buf,
+                                         phys_burst_len(addr, l, len, p), 0);
+                }
+                if (bl > 0) {
+                    l = bl;
+                } else if (l >= 4 && ((addr1 & 3) == 0)) {
                     /* 32 bit read access */
                     val = io_mem_read[io_index][2](io_mem_opaque[io_index], addr1);
                     stl_p(buf, val);
@@ -4170,6 +4658,9 @@ static int cpu_physical_memory_rw1(target_phys_addr_t addr, uint8_t *buf,
                 tl = qemu_get_ram_tlmblock(pd & TARGET_PAGE_MASK);
                 is_ram = 1;
                 if (tl) {
+                    if (is_burst) {
+                        l = phys_burst_len(addr, l, len, p);
+                    }
                     if (is_debug) {
                         tl->bus_access_dbg(tl->opaque, -1, 0,
                                              addr, (void *) buf, l);
@@ -4193,13 +4684,19 @@ static int cpu_physical_memory_rw1(target_phys_addr_t addr, uint8_t *buf,
 int cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                             int len, int is_write)
 {
-    return cpu_physical_memory_rw1(addr, buf, len, is_write, 0);
+    return cpu_physical_memory_rw1(addr, buf, len, is_write, 0, 0);
+}
+
+int cpu_physical_memory_rw_burst(target_phys_addr_t addr, uint8_t *buf,
+                                 int len, int is_write)
+{
+    return cpu_physical_memory_rw1(addr, buf, len, is_write, 0, 1);
 }
 
 void cpu_physical_memory_rw_debug(target_phys_addr_t addr, uint8_t *buf,
                                   int len, int is_write)
 {
-    cpu_physical_memory_rw1(addr, buf, len, is_write, 1);
+    cpu_physical_memory_rw1(addr, buf, len, is_write, 1, 0);
 }
 
 /* used for ROM loading : can write in RAM and ROM */
@@ -4239,6 +4736,7 @@ void cpu_physical_memory_write_rom(target_phys_addr_t addr,
             if (tl) {
                 tl->bus_access_dbg(tl->opaque, -1, 1,
                                      addr, (void *) buf, len);
+                tlm_ram_written(tl->tlm_dev, addr, l);
             } else {
                 memcpy(ptr, buf, l);
             }
@@ -4913,7 +5411,7 @@ int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
         if (is_write)
             cpu_physical_memory_write_rom(phys_addr, buf, l);
         else
-            cpu_physical_memory_rw1(phys_addr, buf, l, is_write, 1);
+            cpu_physical_memory_rw1(phys_addr, buf, l, is_write, 1, 0);
         len -= l;
         buf += l;
         addr += l;
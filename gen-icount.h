@@ -5,12 +5,50 @@
 static TCGArg *icount_arg;
 static int icount_label;
 
+/* Count an execution of the TB being translated, see cpu_gen_code.  */
+static inline void gen_tb_prof(void)
+{
+    TCGv_ptr ptr;
+    TCGv_i64 count;
+
+    if (!gen_tb_prof_counter)
+        return;
+
+    ptr = tcg_const_ptr((tcg_target_long)gen_tb_prof_counter);
+    count = tcg_temp_new_i64();
+    tcg_gen_ld_i64(count, ptr, 0);
+    tcg_gen_addi_i64(count, count, 1);
+    tcg_gen_st_i64(count, ptr, 0);
+    tcg_temp_free_i64(count);
+    tcg_temp_free_ptr(ptr);
+}
+
+/* Trace executions of the TB being translated, see tlm_trace_tb.  */
+static inline void gen_tb_trace_exec(void)
+{
+    TCGv_ptr tb;
+    TCGArg args[1];
+
+    if (!gen_tb_trace)
+        return;
+
+    tb = tcg_const_ptr((tcg_target_long)gen_tb_trace);
+    args[0] = GET_TCGV_PTR(tb);
+    tcg_gen_helperN(tlm_trace_tb, 0,
+                    tcg_gen_sizemask(1, TCG_TARGET_REG_BITS == 64, 0),
+                    TCG_CALL_DUMMY_ARG, 1, args);
+    tcg_temp_free_ptr(tb);
+}
+
 static inline void gen_icount_start(void)
 {
     TCGv_i32 count;
 
-    if (!use_icount)
+    if (!use_icount) {
+        gen_tb_prof();
+        gen_tb_trace_exec();
         return;
+    }
 
     icount_label = gen_new_label();
     count = tcg_temp_local_new_i32();
@@ -22,6 +60,9 @@ static inline void gen_icount_start(void)
     tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, icount_label);
     tcg_gen_st16_i32(count, cpu_env, offsetof(CPUState, icount_decr.u16.low));
     tcg_temp_free_i32(count);
+    /* Only count executions that got past the icount check.  */
+    gen_tb_prof();
+    gen_tb_trace_exec();
 }
 
 static void gen_icount_end(TranslationBlock *tb, int num_insns)
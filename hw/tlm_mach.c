@@ -91,9 +91,12 @@ void tlm_mach_init_common (ram_addr_t ram_size,
                        const char *kernel_filename, const char *kernel_cmdline,
                        const char *initrd_filename, const char *cpu_model)
 {
-    CPUState *env_;
+    CPUState *env;
     qemu_irq *cpu_irq;
+    uint32_t nr_irq;
+    int32_t *irq_vector;
     int kernel_size;
+    int n;
 
     /* init CPUs */
     if (cpu_model == NULL) {
@@ -101,31 +104,43 @@ void tlm_mach_init_common (ram_addr_t ram_size,
         exit(1);
     }
 
-    env_ = cpu_init(cpu_model);
+    for (n = 0; n < smp_cpus; n++) {
+        env = cpu_init(cpu_model);
 
-    if (!env_) {
-        fprintf(stderr, "FATAL: Unable to create cpu %s env=%p\n", cpu_model, env_);
-        exit(1);
-    }
-    qemu_register_reset(main_cpu_reset, env_);
+        if (!env) {
+            fprintf(stderr, "FATAL: Unable to create cpu %s env=%p\n",
+                    cpu_model, env);
+            exit(1);
+        }
+        qemu_register_reset(main_cpu_reset, env);
 
-    configure_cpu(env_);
+        configure_cpu(env);
 #ifdef TARGET_CRIS
-    cpu_irq = cris_pic_init_cpu(env_);
-    tlm_map(env_, 0x0ULL, 0xffffffffULL,
-            tlm_sync_period_ns, cpu_irq, 1, &env_->interrupt_vector);
+        cpu_irq = cris_pic_init_cpu(env);
+        nr_irq = 1;
+        irq_vector = &env->interrupt_vector;
 #elif defined(TARGET_MIPS)
-    cpu_irq = NULL;
-    cpu_mips_irq_init_cpu(env_);
-    cpu_mips_clock_init(env_);
-    tlm_map(env_, 0x0ULL, 0xffffffffULL,
-            tlm_sync_period_ns, cpu_irq, 0, NULL);
+        cpu_irq = NULL;
+        cpu_mips_irq_init_cpu(env);
+        cpu_mips_clock_init(env);
+        nr_irq = 0;
+        irq_vector = NULL;
 #elif defined(TARGET_ARM)
-    cpu_irq = arm_pic_init_cpu(env_);
-    tlm_map(env_, 0x0ULL, 0xffffffffULL,
-            tlm_sync_period_ns, cpu_irq, 2, NULL);
+        cpu_irq = arm_pic_init_cpu(env);
+        nr_irq = 2;
+        irq_vector = NULL;
 #endif
 
+        /* All cores share the bus mapping of the first one but get
+           interrupt lines of their own.  */
+        if (n == 0) {
+            tlm_map(env, 0x0ULL, 0xffffffffULL,
+                    tlm_sync_period_ns, cpu_irq, nr_irq, irq_vector);
+        } else {
+            tlm_map_irq(env, tlm_sync_period_ns, cpu_irq, nr_irq, irq_vector);
+        }
+    }
+
     tlm_register_rams();
 
    if (kernel_filename) {
@@ -174,6 +189,7 @@ static QEMUMachine tlm_mach_machine = {
     .name = "tlm-mach",
     .desc = "TLM Machine",
     .init = tlm_mach_init,
+    .max_cpus = TLM_MAX_CPUS,
 };
 
 static void tlm_mach_machine_init(void)
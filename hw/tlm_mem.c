@@ -27,13 +27,28 @@
 #include "qemu-char.h"
 #include "qemu-timer.h"
 #include "qemu-log.h"
+#include "host-utils.h"
 #include "qdev-addr.h"
 
 #include "gdbstub.h"
 #include "tlm.h"
+#include "tlm_mem.h"
 
 #define D(x)
 
+/* Max number of DMI regions cached per TLMMemory.  */
+#define TLM_DMI_CACHE_SIZE 16
+
+/* Line fill read cache geometry, direct mapped.  */
+#define TLM_LINE_ENTRIES 64
+#define TLM_LINE_MAX     256
+
+struct tlm_line {
+    uint64_t addr;
+    int valid;
+    uint8_t data[TLM_LINE_MAX];
+};
+
 /* There is one of these instantiated per memory/IO area. The first one
    is the only one with valid IRQ connections, the rest are only meant to
    be used for RAM maps.  */
@@ -44,16 +59,37 @@ struct TLMMemory {
     QEMUBH *sync_bh;
     QEMUBH *irq_bh;
     ptimer_state *sync_ptimer;
+    QEMUTimer *quantum_timer;
+    int64_t quantum_edge;
     qemu_irq *cpu_irq;
 
     int is_ram;
+    /* Set for areas mapped with tlm_map_ram. Their DMI regions may be
+       installed in the TLB.  */
+    int ram_map;
     uint64_t base_addr;
     uint64_t size;
     uint64_t sync_period_ns;
+    /* Last sync after a DMI access to this area, see tlm_dmi_sync.  */
+    int64_t last_dmi_sync;
     uint32_t pending_irq[16]; /* max 512 irqs.  */
+    /* Levels last delivered to cpu_irq.  */
+    uint32_t irq_level[16];
     uint32_t nr_irq;
+    /* Set while changes to pending_irq wait for the next TB boundary.  */
+    int irq_deferred;
 
-    struct tlmu_dmi dmi;
+    /* DMI regions granted by the main emulator, sorted by base address
+       and non-overlapping.  */
+    struct tlmu_dmi dmi[TLM_DMI_CACHE_SIZE];
+    unsigned int nr_dmi;
+    /* Index of the most recently hit region.  */
+    unsigned int dmi_last;
+
+    /* Line fill cache for RAM maps without DMI, allocated on first use.  */
+    struct tlm_line *lines;
+    /* tlm_line_size the cached lines got fetched with.  */
+    uint32_t line_size;
 
     void *irq_vector;
 };
@@ -64,6 +100,8 @@ struct TLMRegisterRamEntry {
     uint64_t size;
     int rw;
     int iodev;
+    /* Host memory backing the RAM, NULL to go through the bus.  */
+    void *host;
 
     struct TLMMemory *mem;
     struct TLMRegisterRamEntry *next;
@@ -71,22 +109,104 @@ struct TLMRegisterRamEntry {
 
 static struct TLMRegisterRamEntry *tlm_register_ram_entries = NULL;
 struct TLMMemory *main_tlmdev = NULL;
+/* TLMMemory areas carrying the interrupts of each core.  */
+static struct TLMMemory *tlm_cpu_dev[TLM_MAX_CPUS];
+/* TLMMemory areas indexed by their IO memory index.  */
+static struct TLMMemory *tlm_iodev_mem[IO_MEM_NB_ENTRIES];
 
 void notdirty_mem_wr(target_phys_addr_t ram_addr, int len);
 
-static void tlm_write_irq(struct tlmu_irq *qirq)
+/* Drop any TLB entries pointing into the DMI regions of s.  */
+static void tlm_dmi_tlb_flush(struct TLMMemory *s)
 {
-    assert(main_tlmdev);
+    CPUState *env;
 
-    if ((qirq->addr / 4) > main_tlmdev->nr_irq) {
+    if (!tlm_dmi_tlb || !s->ram_map) {
+        return;
+    }
+
+    for (env = first_cpu; env; env = env->next_cpu) {
+        tlb_flush(env, 1);
+    }
+}
+
+static void update_irq(void *opaque);
+
+/*
+ * Deliver changes to pending_irq. In synchronous mode they get delivered
+ * right away if no CPU is in the middle of a TB, otherwise at the next TB
+ * boundary, see tlm_irq_flush. Raising an interrupt mid TB is not allowed
+ * with -icount.
+ */
+static void tlm_irq_changed(struct TLMMemory *s)
+{
+    CPUState *env = cpu_single_env;
+
+    if (!tlm_irq_sync) {
+        qemu_bh_schedule(s->irq_bh);
+        return;
+    }
+
+    if (!env || can_do_io(env)) {
+        update_irq(s);
+        return;
+    }
+
+    s->irq_deferred = 1;
+    tlm_irq_pending = 1;
+    cpu_exit(env);
+}
+
+static void tlm_write_irq(struct TLMMemory *s, struct tlmu_irq *qirq)
+{
+    unsigned int regnr = qirq->addr / 4;
+
+    if (regnr > s->nr_irq) {
        /* This is a write to the vector.  */
-       if (main_tlmdev->irq_vector) {
-           * (uint32_t *) main_tlmdev->irq_vector = qirq->data;
+       if (s->irq_vector) {
+           * (uint32_t *) s->irq_vector = qirq->data;
        }
     }
 
-    main_tlmdev->pending_irq[qirq->addr / 4] = qirq->data;
-    qemu_bh_schedule(main_tlmdev->irq_bh);
+    if (regnr >= ARRAY_SIZE(s->pending_irq)) {
+        return;
+    }
+    s->pending_irq[regnr] = qirq->data;
+    tlm_irq_changed(s);
+}
+
+void tlm_set_irq(int line, int level)
+{
+    struct TLMMemory *s = main_tlmdev;
+    uint32_t mask = 1U << (line & 31);
+
+    assert(s);
+    if (line < 0 || line >= s->nr_irq) {
+        return;
+    }
+
+    if (level) {
+        s->pending_irq[line / 32] |= mask;
+    } else {
+        s->pending_irq[line / 32] &= ~mask;
+    }
+    tlm_irq_changed(s);
+}
+
+/* Called by the CPU loop at TB boundaries when tlm_irq_pending is set.  */
+void tlm_irq_flush(void)
+{
+    int i;
+
+    tlm_irq_pending = 0;
+    if (main_tlmdev && main_tlmdev->irq_deferred) {
+        update_irq(main_tlmdev);
+    }
+    for (i = 0; i < TLM_MAX_CPUS; i++) {
+        if (tlm_cpu_dev[i] && tlm_cpu_dev[i]->irq_deferred) {
+            update_irq(tlm_cpu_dev[i]);
+        }
+    }
 }
 
 int tlm_bus_access(int rw, uint64_t addr, void *data, int len)
@@ -95,6 +215,13 @@ int tlm_bus_access(int rw, uint64_t addr, void *data, int len)
     return r;
 }
 
+/* Like tlm_bus_access but moves the data with as few accesses as
+   possible rather than word by word.  */
+int tlm_bus_access_burst(int rw, uint64_t addr, void *data, int len)
+{
+    return cpu_physical_memory_rw_burst(addr, data, len, rw);
+}
+
 void tlm_bus_access_dbg(int rw, uint64_t addr, void *data, int len)
 {
     cpu_physical_memory_rw_debug(addr, data, len, rw);
@@ -116,9 +243,87 @@ int tlm_get_dmi_ptr(struct tlmu_dmi *dmi)
     return dmi->ptr != NULL;
 }
 
-static inline
-int dmi_check_flags(struct TLMMemory *s, int flags) {
-	return (s->dmi.prot & flags) == flags;
+static inline int dmi_overlaps(struct tlmu_dmi *dmi,
+                               uint64_t start, uint64_t end)
+{
+    return start < (dmi->base + dmi->size) && end >= dmi->base;
+}
+
+/* Drop all cached DMI regions that overlap with start - end.  */
+static void tlm_dmi_remove(struct TLMMemory *s, uint64_t start, uint64_t end)
+{
+    unsigned int i, j;
+
+    for (i = 0, j = 0; i < s->nr_dmi; i++) {
+        if (dmi_overlaps(&s->dmi[i], start, end)) {
+            continue;
+        }
+        s->dmi[j++] = s->dmi[i];
+    }
+    if (j != s->nr_dmi) {
+        tlm_dmi_tlb_flush(s);
+    }
+    s->nr_dmi = j;
+    s->dmi_last = 0;
+}
+
+static void tlm_line_invalidate(struct TLMMemory *s,
+                                uint64_t start, uint64_t end);
+
+/* Insert a new region, keeping the cache sorted.  */
+static void tlm_dmi_insert(struct TLMMemory *s, struct tlmu_dmi *dmi)
+{
+    unsigned int i;
+
+    tlm_dmi_remove(s, dmi->base, dmi->base + dmi->size - 1);
+    if (s->nr_dmi == TLM_DMI_CACHE_SIZE) {
+        /* Full, evict the last one.  */
+        s->nr_dmi--;
+        tlm_line_invalidate(s, s->dmi[s->nr_dmi].base,
+                            s->dmi[s->nr_dmi].base
+                            + s->dmi[s->nr_dmi].size - 1);
+    }
+
+    for (i = s->nr_dmi; i > 0 && s->dmi[i - 1].base > dmi->base; i--) {
+        s->dmi[i] = s->dmi[i - 1];
+    }
+    s->dmi[i] = *dmi;
+    s->nr_dmi++;
+    tlm_stats.dmi_grants++;
+    s->dmi_last = i;
+
+    /* The region may get written behind the cached lines' back.  */
+    tlm_line_invalidate(s, dmi->base, dmi->base + dmi->size - 1);
+
+    /* Let the next TLB fill pick up the new region.  */
+    tlm_dmi_tlb_flush(s);
+}
+
+/* Drop all cached lines that overlap with start - end.  */
+static void tlm_line_invalidate(struct TLMMemory *s,
+                                uint64_t start, uint64_t end)
+{
+    uint64_t addr;
+    struct tlm_line *line;
+
+    /* Lines stay cached while line fills are disabled, so this goes by
+       the size they were fetched with.  */
+    if (!s->lines || !s->line_size) {
+        return;
+    }
+
+    if (end - start >= (uint64_t) TLM_LINE_ENTRIES * s->line_size) {
+        memset(s->lines, 0, TLM_LINE_ENTRIES * sizeof *s->lines);
+        return;
+    }
+
+    for (addr = start & ~(uint64_t) (s->line_size - 1); addr <= end;
+         addr += s->line_size) {
+        line = &s->lines[(addr / s->line_size) % TLM_LINE_ENTRIES];
+        if (line->valid && line->addr == addr) {
+            line->valid = 0;
+        }
+    }
 }
 
 /*
@@ -128,9 +333,9 @@ int dmi_check_flags(struct TLMMemory *s, int flags) {
 static void tlm_check_invalidate_dmi(struct TLMMemory *s,
                                      uint64_t start, uint64_t end)
 {
-    if (start > s->base_addr && start < (s->base_addr + s->size)) {
-        s->dmi.ptr = NULL;
-        s->dmi.prot = 0;
+    if (start < (s->base_addr + s->size) && end >= s->base_addr) {
+        tlm_dmi_remove(s, start, end);
+        tlm_line_invalidate(s, start, end);
     }
 }
 
@@ -144,6 +349,7 @@ static void tlm_invalidate_dmi(struct tlmu_dmi *dmi)
     struct TLMMemory *s;
     uint64_t start, end;
 
+    tlm_stats.dmi_invalidations++;
     start = dmi->base;
     end = dmi->base + dmi->size;
 
@@ -160,30 +366,189 @@ static void tlm_invalidate_dmi(struct tlmu_dmi *dmi)
 
 static void tlm_try_dmi(struct TLMMemory *s, uint64_t addr, int len)
 {
+    struct tlmu_dmi dmi;
+
     if (tlm_get_dmi_ptr_cb) {
-        tlm_get_dmi_ptr_cb(tlm_opaque, addr, &s->dmi);
+        memset(&dmi, 0, sizeof dmi);
+        tlm_get_dmi_ptr_cb(tlm_opaque, addr, &dmi);
+        if (!dmi.ptr || !dmi.size
+            || !(dmi.prot & (TLMU_DMI_PROT_READ | TLMU_DMI_PROT_WRITE))) {
+            return;
+        }
+
         /* If we got a readable aligned ptr, make it a fast one!  */
-        if (s->dmi.ptr && (s->dmi.prot & TLMU_DMI_PROT_READ)) {
-            intptr_t p = (intptr_t) s->dmi.ptr;
-            if (s->dmi.base == s->base_addr
-                && s->dmi.size == s->size
+        if (dmi.prot & TLMU_DMI_PROT_READ) {
+            intptr_t p = (intptr_t) dmi.ptr;
+            if (dmi.base == s->base_addr
+                && dmi.size == s->size
                 && (p & 0x3) == 0) {
-                s->dmi.prot |= TLMU_DMI_PROT_FAST;
+                dmi.prot |= TLMU_DMI_PROT_FAST;
             }
         }
+        tlm_dmi_insert(s, &dmi);
     }
 }
 
-static
-int dmi_is_allowed(struct TLMMemory *s, int flags, uint64_t addr, int len)
+/*
+ * Lookup the DMI region covering addr - addr + len - 1. Tries the last hit
+ * first and then does a binary search over the sorted regions.
+ */
+static inline struct tlmu_dmi *
+dmi_is_allowed(struct TLMMemory *s, int flags, uint64_t addr, int len)
 {
-    if (s->dmi.ptr && s->dmi.prot & flags) {
-        if (addr >= s->dmi.base
-            && (addr + len - 1) <= (s->dmi.base + s->dmi.size)) {
-            return 1;
+    struct tlmu_dmi *dmi;
+    unsigned int lo, hi, mid;
+
+    if (!s->nr_dmi) {
+        return NULL;
+    }
+
+    dmi = &s->dmi[s->dmi_last];
+    if (addr < dmi->base || (addr + len) > (dmi->base + dmi->size)) {
+        /* Find the last region starting at or below addr.  */
+        lo = 0;
+        hi = s->nr_dmi;
+        while (hi - lo > 1) {
+            mid = (lo + hi) / 2;
+            if (s->dmi[mid].base <= addr) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
         }
+        dmi = &s->dmi[lo];
+        if (addr < dmi->base || (addr + len) > (dmi->base + dmi->size)) {
+            return NULL;
+        }
+        s->dmi_last = lo;
     }
-    return 0;
+    return (dmi->prot & flags) ? dmi : NULL;
+}
+
+/*
+ * Trace a guest bus access, see tlmu_trace_set_mem. Costs one load and a
+ * branch while tracing is off.
+ */
+static inline void tlm_trace_mem(int rw, uint64_t addr, int len,
+                                 uint32_t flags)
+{
+    CPUState *env = cpu_single_env;
+
+    if (likely(!tlm_trace.mem_sample) || !tlm_trace.recs) {
+        return;
+    }
+    if (tlm_trace.mem_skip > 1) {
+        tlm_trace.mem_skip--;
+        return;
+    }
+    tlm_trace.mem_skip = tlm_trace.mem_sample;
+    tlm_trace_put(rw ? TLMU_TRACE_MEM_WRITE : TLMU_TRACE_MEM_READ,
+                  env ? env->cpu_index : 0, tlm_trace_icount(env),
+                  addr, len | flags);
+}
+
+/*
+ * Try to serve a read from the line fill cache, fetching the whole
+ * aligned line on a miss. Returns zero if the access can't be cached.
+ * Stores through DMI TLB mappings never reach us, so the cache is off
+ * while those are enabled.
+ */
+static int tlm_line_read(struct TLMMemory *s, uint64_t eaddr, int len,
+                         uint32_t *r)
+{
+    uint64_t addr = eaddr & ~(uint64_t) (tlm_line_size - 1);
+    struct tlm_line *line;
+    int64_t clk;
+    int dmi_supported;
+
+    if (tlm_dmi_tlb) {
+        /* Start from scratch should the cache get used again.  */
+        s->line_size = 0;
+        return 0;
+    }
+    if (!tlm_line_size || !s->ram_map
+        || tlm_line_size > TLM_LINE_MAX
+        || (tlm_line_size & (tlm_line_size - 1))
+        || eaddr + len > addr + tlm_line_size
+        || addr < s->base_addr
+        || addr + tlm_line_size > s->base_addr + s->size) {
+        return 0;
+    }
+
+    if (!s->lines) {
+        s->lines = g_malloc0(TLM_LINE_ENTRIES * sizeof *s->lines);
+    }
+    /* Lines of another size don't match the tags anymore.  */
+    if (s->line_size != tlm_line_size) {
+        memset(s->lines, 0, TLM_LINE_ENTRIES * sizeof *s->lines);
+        s->line_size = tlm_line_size;
+    }
+
+    line = &s->lines[(addr / tlm_line_size) % TLM_LINE_ENTRIES];
+    if (!line->valid || line->addr != addr) {
+        clk = qemu_get_clock_ns(vm_clock);
+        tlm_stats.dmi_misses++;
+        tlm_stats.bus_accesses++;
+        dmi_supported = tlm_bus_access_cb(tlm_opaque, clk, 0, addr,
+                                          line->data, tlm_line_size);
+        line->addr = addr;
+        line->valid = 1;
+        if (dmi_supported) {
+            tlm_try_dmi(s, eaddr, len);
+        }
+    } else {
+        tlm_stats.line_hits++;
+    }
+    memcpy(r, line->data + (eaddr - addr), len);
+    return 1;
+}
+
+/*
+ * Sync after a DMI access to a non RAM area. In decoupled mode we only
+ * sync once per sync period and area, TB exits and bus accesses sync
+ * anyway.
+ */
+static void tlm_dmi_sync(struct TLMMemory *s)
+{
+    int64_t clk;
+
+    clk = qemu_get_clock_ns(vm_clock);
+    if (tlm_sync_decoupled && clk >= s->last_dmi_sync
+        && (uint64_t) (clk - s->last_dmi_sync) < tlm_sync_period_ns) {
+        return;
+    }
+    s->last_dmi_sync = clk;
+    tlm_stats.syncs++;
+    tlm_sync(tlm_opaque, clk);
+}
+
+/* Used by exec.c when writing to TLM RAMs without going through us.  */
+void tlm_ram_written(void *dev, uint64_t addr, int len)
+{
+    struct TLMMemory *s = dev;
+
+    if (s) {
+        tlm_line_invalidate(s, addr, addr + len - 1);
+    }
+}
+
+/* Used by exec.c to map DMI regions of TLM RAMs straight into the TLB.  */
+void *tlm_dmi_tlb_ptr(void *dev, uint64_t addr, uint64_t len, int write)
+{
+    struct TLMMemory *s = dev;
+    struct tlmu_dmi *dmi;
+
+    /* Keep traced accesses going through us.  */
+    if (!tlm_dmi_tlb || !s || tlm_trace.mem_sample) {
+        return NULL;
+    }
+
+    dmi = dmi_is_allowed(s, write ? TLMU_DMI_PROT_WRITE : TLMU_DMI_PROT_READ,
+                         addr, len);
+    if (!dmi) {
+        return NULL;
+    }
+    return (char *) dmi->ptr + (addr - dmi->base);
 }
 
 static inline
@@ -193,27 +558,40 @@ uint32_t tlm_read(struct TLMMemory *s, target_phys_addr_t addr, int len)
     uint64_t eaddr = s->base_addr + addr;
     int64_t clk;
     int dmi_supported;
+    struct tlmu_dmi *dmi;
 
 //    qemu_log("%s: addr=%lx,%lx.%lx len=%d\n", __func__, s->base_addr, eaddr, (unsigned long) addr, len);
 
-    if (dmi_is_allowed(s, TLMU_DMI_PROT_READ, eaddr, len)) {
+    dmi = dmi_is_allowed(s, TLMU_DMI_PROT_READ, eaddr, len);
+    if (dmi) {
         int offset;
-        char *p = s->dmi.ptr;
+        char *p = dmi->ptr;
 
-        offset = eaddr - s->dmi.base;
+        tlm_stats.dmi_hits++;
+
+        offset = eaddr - dmi->base;
         p += offset;
         memcpy(&r, p, len);
-        qemu_icount += s->dmi.read_latency * len;
+        tlm_trace_mem(0, eaddr, len, TLMU_TRACE_MEM_DMI);
+        qemu_icount += dmi->read_latency * len;
         if (!s->is_ram) {
-            clk = qemu_get_clock_ns(vm_clock);
-            tlm_sync(tlm_opaque, clk);
+            tlm_dmi_sync(s);
         }
         return r;
     }
 
+    if (tlm_line_read(s, eaddr, len, &r)) {
+        tlm_trace_mem(0, eaddr, len, TLMU_TRACE_MEM_LINE);
+        return r;
+    }
+
+    tlm_stats.dmi_misses++;
+    tlm_trace_mem(0, eaddr, len, 0);
     clk = qemu_get_clock_ns(vm_clock);
+    tlm_stats.bus_accesses++;
     dmi_supported = tlm_bus_access_cb(tlm_opaque, clk, 0, eaddr, &r, len);
-    if (dmi_supported && !s->dmi.prot) {
+    if (dmi_supported && !dmi_is_allowed(s, TLMU_DMI_PROT_READ
+                                         | TLMU_DMI_PROT_WRITE, eaddr, len)) {
         tlm_try_dmi(s, eaddr, len);
     }
 
@@ -227,32 +605,100 @@ tlm_write(struct TLMMemory *s, target_phys_addr_t addr, uint32_t value, int len)
     uint64_t eaddr = s->base_addr + addr;
     int64_t clk;
     int dmi_supported;
+    struct tlmu_dmi *dmi;
 
     if (s->is_ram) {
         notdirty_mem_wr(eaddr, len);
     }
+    tlm_line_invalidate(s, eaddr, eaddr + len - 1);
 //    qemu_log("%s: addr=%lx.%lx value=%x len=%d\n", __func__, eaddr, (unsigned long) addr, value, len);
 
-    if (dmi_is_allowed(s, TLMU_DMI_PROT_WRITE, eaddr, len)) {
+    dmi = dmi_is_allowed(s, TLMU_DMI_PROT_WRITE, eaddr, len);
+    if (dmi) {
         int offset;
-        char *p = s->dmi.ptr;
+        char *p = dmi->ptr;
 
-        offset = eaddr - s->dmi.base;
+        tlm_stats.dmi_hits++;
+
+        offset = eaddr - dmi->base;
         p += offset;
         memcpy(p, &value, len);
-        qemu_icount += s->dmi.write_latency * len;
+        tlm_trace_mem(1, eaddr, len, TLMU_TRACE_MEM_DMI);
+        qemu_icount += dmi->write_latency * len;
         if (!s->is_ram) {
-            clk = qemu_get_clock_ns(vm_clock);
-            tlm_sync(tlm_opaque, clk);
+            tlm_dmi_sync(s);
         }
         return;
     }
 
+    tlm_stats.dmi_misses++;
+    tlm_trace_mem(1, eaddr, len, 0);
     clk = qemu_get_clock_ns(vm_clock);
+    tlm_stats.bus_accesses++;
     dmi_supported = tlm_bus_access_cb(tlm_opaque, clk, 1, eaddr, &value, len);
-    if (dmi_supported && !s->dmi.prot) {
+    if (dmi_supported && !dmi_is_allowed(s, TLMU_DMI_PROT_READ
+                                         | TLMU_DMI_PROT_WRITE, eaddr, len)) {
+        tlm_try_dmi(s, eaddr, len);
+    }
+}
+
+/* Used by exec.c to make a single bus access for a burst into a TLM area.  */
+int tlm_iodev_burst(int io_index, uint64_t addr, void *buf, int len,
+                    int is_write)
+{
+    struct TLMMemory *s = tlm_iodev_mem[io_index];
+    uint64_t eaddr;
+    int64_t clk;
+    int dmi_supported;
+    struct tlmu_dmi *dmi;
+
+    if (!s || addr >= s->size) {
+        return 0;
+    }
+    if (len > s->size - addr) {
+        len = s->size - addr;
+    }
+    eaddr = s->base_addr + addr;
+
+    if (is_write) {
+        if (s->is_ram) {
+            notdirty_mem_wr(eaddr, len);
+        }
+        tlm_line_invalidate(s, eaddr, eaddr + len - 1);
+    }
+
+    dmi = dmi_is_allowed(s, is_write ? TLMU_DMI_PROT_WRITE
+                                     : TLMU_DMI_PROT_READ, eaddr, len);
+    if (dmi) {
+        char *p = dmi->ptr;
+
+        tlm_stats.dmi_hits++;
+        tlm_trace_mem(is_write, eaddr, len, TLMU_TRACE_MEM_DMI);
+        p += eaddr - dmi->base;
+        if (is_write) {
+            memcpy(p, buf, len);
+            qemu_icount += dmi->write_latency * len;
+        } else {
+            memcpy(buf, p, len);
+            qemu_icount += dmi->read_latency * len;
+        }
+        if (!s->is_ram) {
+            tlm_dmi_sync(s);
+        }
+        return len;
+    }
+
+    tlm_stats.dmi_misses++;
+    tlm_trace_mem(is_write, eaddr, len, 0);
+    clk = qemu_get_clock_ns(vm_clock);
+    tlm_stats.bus_accesses++;
+    dmi_supported = tlm_bus_access_cb(tlm_opaque, clk, is_write, eaddr,
+                                      buf, len);
+    if (dmi_supported && !dmi_is_allowed(s, TLMU_DMI_PROT_READ
+                                         | TLMU_DMI_PROT_WRITE, eaddr, len)) {
         tlm_try_dmi(s, eaddr, len);
     }
+    return len;
 }
 
 static uint32_t tlm_read8(void *opaque, target_phys_addr_t addr)
@@ -295,21 +741,41 @@ static CPUWriteMemoryFunc *tlm_write_f[] = {
     &tlm_write8, &tlm_write16, &tlm_write32,
 };
 
+/* Only the lines that changed since the last update get set.  */
 static void update_irq(void *opaque)
 {
     struct TLMMemory *s = opaque;
-    int i;
+    uint32_t changed;
+    int regnr, bitnr;
+
+    s->irq_deferred = 0;
+    for (regnr = 0; regnr * 32 < s->nr_irq; regnr++) {
+        changed = s->pending_irq[regnr] ^ s->irq_level[regnr];
+        if (s->nr_irq - regnr * 32 < 32) {
+            changed &= (1U << (s->nr_irq - regnr * 32)) - 1;
+        }
+        s->irq_level[regnr] ^= changed;
+
+        while (changed) {
+            bitnr = ctz32(changed);
+            changed &= changed - 1;
+            tlm_stats.irq_updates++;
+            qemu_set_irq(s->cpu_irq[regnr * 32 + bitnr],
+                         (s->irq_level[regnr] >> bitnr) & 1);
+        }
+    }
+}
 
-    for (i = 0; i < s->nr_irq; i++) {
-        int regnr = i / 32;
-        int bitnr = i & 0x1f;
-        uint32_t data;
-        int level;
+/* The CPUs forget their interrupt state on reset, redeliver all lines.  */
+static void tlm_irq_reset(void *opaque)
+{
+    struct TLMMemory *s = opaque;
+    int i;
 
-        data = s->pending_irq[regnr];
-        level = !!(data & (1 << bitnr));
-        qemu_set_irq(s->cpu_irq[i], level);
+    for (i = 0; i < ARRAY_SIZE(s->irq_level); i++) {
+        s->irq_level[i] = ~s->pending_irq[i];
     }
+    qemu_bh_schedule(s->irq_bh);
 }
 
 static void timer_hit(void *opaque)
@@ -318,12 +784,72 @@ static void timer_hit(void *opaque)
     cpu_interrupt(s->cpu_env, CPU_INTERRUPT_EXITTB);
 }
 
-void tlm_notify_event(enum tlmu_event ev, void *d)
+/* Stop at the quantum edge and wait for the other instances.  */
+static void tlm_quantum_hit(void *opaque)
 {
-    CPUState *env;
+    struct TLMMemory *s = opaque;
+    int64_t edge = s->quantum_edge;
 
-    assert(main_tlmdev);
-    env = main_tlmdev->cpu_env;
+    s->quantum_edge += tlm_quantum_ns;
+    qemu_mod_timer(s->quantum_timer, s->quantum_edge);
+    tlm_quantum_barrier(tlm_quantum_opaque, edge);
+}
+
+/* icount isn't part of the timer state, but with -icount vm_clock is
+   derived from it.  */
+static void tlm_icount_save(QEMUFile *f, void *opaque)
+{
+    qemu_put_be64(f, qemu_icount);
+    qemu_put_be64(f, qemu_icount_bias);
+}
+
+static int tlm_icount_load(QEMUFile *f, void *opaque, int version_id)
+{
+    struct TLMMemory *s = opaque;
+
+    qemu_icount = qemu_get_be64(f);
+    qemu_icount_bias = qemu_get_be64(f);
+
+    /* Carry on from the first quantum edge after the restored time.  */
+    if (s->quantum_timer) {
+        s->quantum_edge = (qemu_get_clock_ns(vm_clock) / tlm_quantum_ns + 1)
+                          * tlm_quantum_ns;
+        qemu_mod_timer(s->quantum_timer, s->quantum_edge);
+    }
+    return 0;
+}
+
+static QEMUBH *tlm_snapshot_bh;
+static char *tlm_snapshot_file;
+
+static void tlm_snapshot_save_bh(void *opaque)
+{
+    tlm_snapshot_status = qemu_savevm_file(tlm_snapshot_file);
+    g_free(tlm_snapshot_file);
+    tlm_snapshot_file = NULL;
+}
+
+/*
+ * Save the VM state to filename. The CPUs are mid TB when this gets called
+ * from the bus callbacks, so the save is done from a bottom half once they
+ * are back in the main loop. tlm_snapshot_status tells when it is done.
+ */
+int tlm_snapshot_save(const char *filename)
+{
+    if (!tlm_snapshot_bh || tlm_snapshot_file) {
+        return -1;
+    }
+
+    tlm_snapshot_file = g_strdup(filename);
+    tlm_snapshot_status = 1;
+    qemu_bh_schedule(tlm_snapshot_bh);
+    return 0;
+}
+
+static void tlm_notify_event_dev(struct TLMMemory *s,
+                                 enum tlmu_event ev, void *d)
+{
+    CPUState *env = s->cpu_env;
 
     switch (ev) {
         case TLMU_TLM_EVENT_SYNC:
@@ -337,7 +863,7 @@ void tlm_notify_event(enum tlmu_event ev, void *d)
             cpu_interrupt(env, CPU_INTERRUPT_HALT);
             break;
         case TLMU_TLM_EVENT_IRQ:
-            tlm_write_irq(d);
+            tlm_write_irq(s, d);
             break;
         case TLMU_TLM_EVENT_INVALIDATE_DMI:
             tlm_invalidate_dmi(d);
@@ -355,6 +881,49 @@ void tlm_notify_event(enum tlmu_event ev, void *d)
     }
 }
 
+void tlm_notify_event(enum tlmu_event ev, void *d)
+{
+    assert(main_tlmdev);
+    tlm_notify_event_dev(main_tlmdev, ev, d);
+}
+
+/* Like tlm_notify_event but IRQ, WAKE and SLEEP events go to a
+   particular core. The index comes from the main emulator, so a bad one
+   is an error rather than an assertion.  */
+int tlm_notify_event_cpu(int cpu, enum tlmu_event ev, void *d)
+{
+    if (cpu < 0 || cpu >= smp_cpus || cpu >= TLM_MAX_CPUS
+        || !tlm_cpu_dev[cpu]) {
+        return 1;
+    }
+    tlm_notify_event_dev(tlm_cpu_dev[cpu], ev, d);
+    return 0;
+}
+
+/* Index of the core making the current bus access, -1 if it doesn't come
+   from a core.  */
+int tlm_current_cpu(void)
+{
+    return cpu_single_env ? cpu_single_env->cpu_index : -1;
+}
+
+/* Start sampling bus accesses into the trace, see tlmu_trace_set_mem.  */
+void tlm_trace_set_mem(unsigned int sample)
+{
+    CPUState *env;
+
+    tlm_trace.mem_skip = 1;
+    tlm_trace.mem_sample = sample;
+    if (!sample || !tlm_dmi_tlb) {
+        return;
+    }
+
+    /* DMI regions already mapped into the TLB would bypass the trace.  */
+    for (env = first_cpu; env; env = env->next_cpu) {
+        tlb_flush(env, 1);
+    }
+}
+
 static int tlm_memory_init(SysBusDevice *dev)
 {
     struct TLMMemory *s = FROM_SYSBUS(typeof(*s), dev);
@@ -373,6 +942,9 @@ static int tlm_memory_init(SysBusDevice *dev)
     }
 
     s->irq_bh = qemu_bh_new(update_irq, s);
+    if (s->nr_irq) {
+        qemu_register_reset(tlm_irq_reset, s);
+    }
     s->sync_bh = qemu_bh_new(timer_hit, s);
     s->sync_ptimer = ptimer_init(s->sync_bh);
     if (s->sync_period_ns) {
@@ -381,19 +953,64 @@ static int tlm_memory_init(SysBusDevice *dev)
         ptimer_run(s->sync_ptimer, 0);
     }
 
+    if (s->cpu_env) {
+        int cpu = ((CPUState *) s->cpu_env)->cpu_index;
+
+        assert(cpu < TLM_MAX_CPUS);
+        tlm_cpu_dev[cpu] = s;
+    }
+
+    if (!s->size) {
+        /* Interrupts only, see tlm_map_irq.  */
+        return 0;
+    }
+
     io_tlm = cpu_register_io_memory(tlm_read_f, tlm_write_f, s,
                                     DEVICE_NATIVE_ENDIAN);
     sysbus_init_mmio(dev, s->size, io_tlm);
+    tlm_iodev_mem[io_tlm >> IO_MEM_SHIFT] = s;
+
+    /* The vm_clock deadline makes the CPUs stop exactly at the edge.  */
+    if (tlm_quantum_ns && tlm_quantum_barrier && !main_tlmdev) {
+        s->quantum_timer = qemu_new_timer_ns(vm_clock, tlm_quantum_hit, s);
+        s->quantum_edge = tlm_quantum_ns;
+        qemu_mod_timer(s->quantum_timer, s->quantum_edge);
+    }
+
+    if (!main_tlmdev) {
+        register_savevm(NULL, "tlm-icount", 0, 1,
+                        tlm_icount_save, tlm_icount_load, s);
+        tlm_snapshot_bh = qemu_bh_new(tlm_snapshot_save_bh, NULL);
+    }
 
     /* Register the main tlm dev.  Used for interrupts.  */
     main_tlmdev = s;
     return 0;
 }
 
+static int tlm_memory_post_load(void *opaque, int version_id)
+{
+    /* The CPUs come back with their own view of the lines.  */
+    tlm_irq_reset(opaque);
+    return 0;
+}
+
+static const VMStateDescription vmstate_tlm_memory = {
+    .name = "tlm,memory",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = tlm_memory_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(pending_irq, struct TLMMemory, 16),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static SysBusDeviceInfo tlm_memory_info = {
     .init = tlm_memory_init,
     .qdev.name  = "tlm,memory",
     .qdev.size  = sizeof(struct TLMMemory),
+    .qdev.vmsd  = &vmstate_tlm_memory,
     .qdev.props = (Property[]) {
         DEFINE_PROP_UINT64("base_addr", struct TLMMemory, base_addr, 0),
         DEFINE_PROP_UINT64("size", struct TLMMemory, size, 0),
@@ -418,6 +1035,14 @@ static void map_ram(struct TLMRegisterRamEntry *ram)
     struct TLM_RAMBlock tlm_rb = {0};
     int p;
 
+    if (ram->host) {
+        /* Plain RAM shared with the main emulator, no bus accesses.  */
+        p = qemu_ram_alloc_from_ptr(NULL, ram->name, ram->size, ram->host);
+        cpu_register_physical_memory(ram->base, ram->size,
+                                     p | (ram->rw ? IO_MEM_RAM : IO_MEM_ROM));
+        return;
+    }
+
     tlm_rb.opaque = tlm_opaque;
     tlm_rb.base = ram->base;
     tlm_rb.bus_access = tlm_bus_access_cb;
@@ -425,27 +1050,15 @@ static void map_ram(struct TLMRegisterRamEntry *ram)
     ram->iodev = cpu_register_io_memory(tlm_read_f, tlm_write_f, ram->mem,
                                         DEVICE_NATIVE_ENDIAN);
     tlm_rb.iodev = ram->iodev;
+    tlm_rb.tlm_dev = ram->mem;
     p = qemu_ram_alloc_from_ptr_2(NULL, ram->name, ram->size,
                                   ((char *) 0) + ram->base, &tlm_rb);
     cpu_register_physical_memory(ram->base, ram->size,
                                  p | (ram->rw ? IO_MEM_RAM : IO_MEM_ROM));
 }
 
-/* Used by exec-all when mapping in pages for code fetching.  */
-int tlm_iodev_is_ram(int iodev) {
-    struct TLMRegisterRamEntry *ram;
-
-    ram = tlm_register_ram_entries;
-    while (ram) {
-        if (iodev == (ram->iodev >> IO_MEM_SHIFT)) {
-            return 1;
-        }
-        ram = ram->next;
-    }
-    return 0;
-}
-
-void tlm_map_ram(const char *name, uint64_t addr, uint64_t size, int rw)
+void tlm_map_ram_ptr(const char *name, uint64_t addr, uint64_t size, int rw,
+                     void *host)
 {
     struct TLMRegisterRamEntry *ram;
 
@@ -454,9 +1067,11 @@ void tlm_map_ram(const char *name, uint64_t addr, uint64_t size, int rw)
     ram->base = addr;
     ram->size = size;
     ram->rw = rw;
+    ram->host = host;
 
     ram->mem = g_malloc0(sizeof *ram->mem);
     ram->mem->is_ram = rw;
+    ram->mem->ram_map = 1;
     ram->mem->base_addr = addr;
     ram->mem->size = size;
 
@@ -465,6 +1080,11 @@ void tlm_map_ram(const char *name, uint64_t addr, uint64_t size, int rw)
     tlm_register_ram_entries = ram;
 }
 
+void tlm_map_ram(const char *name, uint64_t addr, uint64_t size, int rw)
+{
+    tlm_map_ram_ptr(name, addr, size, rw, NULL);
+}
+
 void tlm_register_rams(void)
 {
     struct TLMRegisterRamEntry *ram;
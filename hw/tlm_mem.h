@@ -1,3 +1,6 @@
+/* Max number of cores on a TLMu machine.  */
+#define TLM_MAX_CPUS 16
+
 /*
  * Map a TLMu area.
  *
@@ -30,3 +33,30 @@ static inline void tlm_map(CPUState *env, uint64_t addr, uint64_t size,
     }
 }
 
+/*
+ * Create an unmapped TLMu device carrying the interrupt lines and events
+ * of a secondary core. Bus accesses from all cores go through the area
+ * mapped with tlm_map.
+ *
+ * env             - CPUState for the connected core.
+ * sync_period_ns  - Sync timer interval
+ * cpu_irq         - Interrupt lines
+ * nr_irq          - Number of interrupt lines
+ */
+static inline void tlm_map_irq(CPUState *env, uint64_t sync_period_ns,
+                               qemu_irq *cpu_irq, uint32_t nr_irq,
+                               int32_t *irq_vector)
+{
+    int i;
+
+    DeviceState *dev;
+    dev = qdev_create(NULL, "tlm,memory");
+    qdev_prop_set_ptr(dev, "cpu_env", env);
+    qdev_prop_set_uint64(dev, "sync_period_ns", sync_period_ns);
+    qdev_prop_set_uint32(dev, "nr_irq", nr_irq);
+    qdev_prop_set_ptr(dev, "irq_vector", irq_vector);
+    qdev_init_nofail(dev);
+    for (i = 0; i < nr_irq; i++) {
+        sysbus_connect_irq(sysbus_from_qdev(dev), i, cpu_irq[i]);
+    }
+}
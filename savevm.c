@@ -2086,6 +2086,47 @@ int load_vmstate(const char *name)
     return 0;
 }
 
+/* Save the VM state to a plain file, without involving block devices.  */
+int qemu_savevm_file(const char *filename)
+{
+    QEMUFile *f;
+    int ret;
+
+    f = qemu_fopen(filename, "wb");
+    if (!f) {
+        error_report("Could not open VM state file %s", filename);
+        return -EIO;
+    }
+
+    ret = qemu_savevm_state(NULL, f);
+    if (qemu_fclose(f) < 0 && !ret) {
+        ret = -EIO;
+    }
+    if (ret < 0) {
+        error_report("Error %d while saving VM state to %s", ret, filename);
+    }
+    return ret;
+}
+
+int qemu_loadvm_file(const char *filename)
+{
+    QEMUFile *f;
+    int ret;
+
+    f = qemu_fopen(filename, "rb");
+    if (!f) {
+        error_report("Could not open VM state file %s", filename);
+        return -EIO;
+    }
+
+    ret = qemu_loadvm_state(f);
+    qemu_fclose(f);
+    if (ret < 0) {
+        error_report("Error %d while loading VM state from %s", ret, filename);
+    }
+    return ret;
+}
+
 void do_delvm(Monitor *mon, const QDict *qdict)
 {
     BlockDriverState *bs, *bs1;
@@ -0,0 +1,51 @@
+#!/usr/bin/env python
+#
+# Pretty-printer for TLMu TB profile files, see tlmu_tb_prof_dump().
+#
+# Copyright (c) 2011 Edgar E. Iglesias.
+#
+# This work is licensed under the terms of the GNU GPL, version 2.  See
+# the COPYING file in the top-level directory.
+#
+# Usage: tlmu-prof.py <file.prof> [nr-entries]
+#
+# Prints the hottest guest code ranges, sorted by insns executed.
+
+import struct
+import sys
+
+prof_magic = 'TLMUPROF'
+prof_version = 1
+hdr_fmt = '=8sII'
+entry_fmt = '=QIIQQ'
+
+def read_prof(fobj):
+    """Return a list of (pc, size, insns, count, icount) tuples."""
+    hdr = fobj.read(struct.calcsize(hdr_fmt))
+    magic, version, n = struct.unpack(hdr_fmt, hdr)
+    if magic.decode('ascii') != prof_magic or version != prof_version:
+        raise ValueError('not a TLMu profile file')
+
+    entry_len = struct.calcsize(entry_fmt)
+    return [struct.unpack(entry_fmt, fobj.read(entry_len)) for i in range(n)]
+
+def main():
+    if len(sys.argv) < 2:
+        sys.stderr.write('usage: %s <file.prof> [nr-entries]\n' % sys.argv[0])
+        sys.exit(1)
+
+    limit = 20
+    if len(sys.argv) > 2:
+        limit = int(sys.argv[2])
+
+    entries = read_prof(open(sys.argv[1], 'rb'))
+    total = sum(e[4] for e in entries) or 1
+    entries.sort(key=lambda e: e[4], reverse=True)
+
+    print('%-23s %12s %14s %6s' % ('pc range', 'count', 'icount', '%'))
+    for pc, size, insns, count, icount in entries[:limit]:
+        print('%08x-%08x %12d %14d %6.2f' % (pc, pc + size, count, icount,
+                                             100.0 * icount / total))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,66 @@
+#!/usr/bin/env python
+#
+# Pretty-printer for TLMu execution traces, see tlmu_trace_start().
+#
+# Copyright (c) 2011 Edgar E. Iglesias.
+#
+# This work is licensed under the terms of the GNU GPL, version 2.  See
+# the COPYING file in the top-level directory.
+#
+# Usage: tlmu-trace.py <file.trace>
+#
+# Prints one line per record, in execution order.
+
+import struct
+import sys
+
+trace_magic = 'TLMUTRAC'
+trace_version = 1
+hdr_fmt = '=8sII'
+rec_fmt = '=QQIHH'
+
+TLMU_TRACE_TB = 0
+TLMU_TRACE_MEM_READ = 1
+TLMU_TRACE_MEM_WRITE = 2
+
+TLMU_TRACE_MEM_DMI = 1 << 31
+TLMU_TRACE_MEM_LINE = 1 << 30
+
+def read_trace(fobj):
+    """Yield (type, cpu, icount, addr, info) tuples."""
+    hdr = fobj.read(struct.calcsize(hdr_fmt))
+    magic, version, rec_len = struct.unpack(hdr_fmt, hdr)
+    if magic.decode('ascii') != trace_magic or version != trace_version \
+       or rec_len != struct.calcsize(rec_fmt):
+        raise ValueError('not a TLMu trace file')
+
+    while True:
+        rec = fobj.read(rec_len)
+        if len(rec) < rec_len:
+            break
+        addr, icount, info, type, cpu = struct.unpack(rec_fmt, rec)
+        yield type, cpu, icount, addr, info
+
+def main():
+    if len(sys.argv) < 2:
+        sys.stderr.write('usage: %s <file.trace>\n' % sys.argv[0])
+        sys.exit(1)
+
+    for type, cpu, icount, addr, info in read_trace(open(sys.argv[1], 'rb')):
+        if type == TLMU_TRACE_TB:
+            print('%d %14d tb   0x%08x insns %d' % (cpu, icount, addr, info))
+        elif type in (TLMU_TRACE_MEM_READ, TLMU_TRACE_MEM_WRITE):
+            via = ''
+            if info & TLMU_TRACE_MEM_DMI:
+                via = ' dmi'
+            elif info & TLMU_TRACE_MEM_LINE:
+                via = ' line'
+            print('%d %14d %-4s 0x%08x len %d%s' % (cpu, icount,
+                  'rd' if type == TLMU_TRACE_MEM_READ else 'wr', addr,
+                  info & 0xffff, via))
+        else:
+            print('%d %14d ?%-3d 0x%08x %08x' % (cpu, icount, type, addr,
+                                                 info))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,1297 @@
+/*
+ * TLMu benchmarks.
+ *
+ * Copyright (c) 2011 Edgar E. Iglesias.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Usage: bench <test> [args]
+ *
+ *   startup [soname]   Time loading 1, 8 and 64 instances.
+ *   dma                Throughput of bus accesses into an ARM instance,
+ *                      checking the data and bursts across two RAMs.
+ *   sync               Syncs/sec and MIPS for an ARM guest counting in
+ *                      a non RAM area through DMI, coupled and decoupled.
+ *   irq                IRQ toggles/sec from every 16th sync callback of
+ *                      the sync guest, delivered from a bottom half or
+ *                      synchronously.
+ *   parallel           Aggregate MIPS for 1, 2 and 4 of the sync guests
+ *                      run with tlmu_run_parallel.
+ *   rams               MIPS for an ARM guest loading from 64 pages spread
+ *                      over 1, 8 and 64 TLM RAMs.
+ *   prof               MIPS for the rams guest with and without TB
+ *                      profiling.
+ *   trace              MIPS for the rams guest without a trace, with an
+ *                      execution trace and with a sampled bus access
+ *                      trace.
+ *   ramptr             MIPS for the rams guest with 8 TLM RAMs and with
+ *                      8 RAMs backed by host memory.
+ *   snapshot           Saves the rams guest half way and runs the rest
+ *                      in a new instance restored from the snapshot.
+ *   translate          Startup time of the c_example guest images and
+ *                      the part of it spent translating code.
+ *   cluster            Translation work for 8 copies of the ARM guest
+ *                      run as 8 instances and as one 8 core instance.
+ *   tbsize             MIPS for a guest with more code than a 1MB
+ *                      translation buffer holds, with and without
+ *                      growing the buffer.
+ *   jmpcache           MIPS for a guest with 16K blocks ending in
+ *                      indirect jumps, with a 4K and a 64K entry jump
+ *                      cache.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "tlmu.h"
+
+static int64_t now_ns(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec * 1000000000LL + tp.tv_nsec;
+}
+
+/* Proportional set size in KB, shared pages are split among users.  */
+static long pss_kb(void)
+{
+	FILE *fp;
+	char line[128];
+	long kb = 0;
+
+	fp = fopen("/proc/self/smaps_rollup", "r");
+	if (!fp)
+		return 0;
+	while (fgets(line, sizeof line, fp)) {
+		if (sscanf(line, "Pss: %ld kB", &kb) == 1)
+			break;
+	}
+	fclose(fp);
+	return kb;
+}
+
+static int bench_startup(int argc, char **argv)
+{
+	static const int counts[] = {1, 8, 64};
+	const char *soname = "libtlmu-arm.so";
+	struct tlmu *t;
+	int total = 0;
+	int i, j;
+
+	if (argc > 0)
+		soname = argv[0];
+
+	for (i = 0; i < sizeof counts / sizeof counts[0]; i++) {
+		int64_t start, end;
+		long pss;
+		int n = counts[i];
+
+		t = calloc(n, sizeof *t);
+		pss = pss_kb();
+		start = now_ns();
+		for (j = 0; j < n; j++) {
+			char *name;
+
+			if (asprintf(&name, "bench%d", total + j) < 0)
+				return 1;
+			tlmu_init(&t[j], name);
+			if (tlmu_load(&t[j], soname)) {
+				printf("failed to load %s instance %d\n",
+					soname, total + j);
+				return 1;
+			}
+		}
+		end = now_ns();
+		total += n;
+
+		printf("startup: %2d instances %8.2f ms %6.2f ms/inst "
+			"pss +%ld KB\n", n,
+			(end - start) / 1e6, (end - start) / 1e6 / n,
+			pss_kb() - pss);
+		/* The instances are never run, leave them loaded.  */
+	}
+	return 0;
+}
+
+/*
+ * The benches below all run a core on the bare tlm-mach machine with
+ * -icount 1 and a 100us sync period. Each one embeds a struct bench_inst
+ * as the first member of its state and passes its hooks to inst_setup,
+ * the hooks get that state back as their opaque. Unset hooks do nothing.
+ */
+struct bench_hooks {
+	int (*bus_access)(void *o, int rw, uint64_t addr, void *data, int len);
+	void (*get_dmi_ptr)(void *o, uint64_t addr, struct tlmu_dmi *dmi);
+	void (*sync)(void *o, int64_t time_ns);
+};
+
+struct bench_inst {
+	struct tlmu q;
+	char name[32];
+	pthread_t tid;
+	const struct bench_hooks *hooks;
+	/* Guest code read from address 0, reads past its end return zeros.  */
+	const void *code;
+	uint64_t code_size;
+};
+
+static int inst_bus_access(void *o, int64_t clk, int rw,
+			uint64_t addr, void *data, int len)
+{
+	struct bench_inst *bi = o;
+
+	if (!rw && addr < bi->code_size) {
+		memset(data, 0, len);
+		memcpy(data, (const char *) bi->code + addr,
+			len < bi->code_size - addr ? len : bi->code_size - addr);
+		return 0;
+	}
+	if (bi->hooks->bus_access)
+		return bi->hooks->bus_access(o, rw, addr, data, len);
+	if (!rw)
+		memset(data, 0, len);
+	return 0;
+}
+
+static void inst_bus_access_dbg(void *o, int64_t clk, int rw,
+			uint64_t addr, void *data, int len)
+{
+	inst_bus_access(o, clk, rw, addr, data, len);
+}
+
+static void inst_get_dmi_ptr(void *o, uint64_t addr, struct tlmu_dmi *dmi)
+{
+	struct bench_inst *bi = o;
+
+	if (bi->hooks->get_dmi_ptr)
+		bi->hooks->get_dmi_ptr(o, addr, dmi);
+}
+
+static void inst_sync(void *o, int64_t time_ns)
+{
+	struct bench_inst *bi = o;
+
+	if (bi->hooks->sync)
+		bi->hooks->sync(o, time_ns);
+}
+
+static int inst_setup(struct bench_inst *bi, const struct bench_hooks *hooks,
+			const char *name, const char *soname, const char *cpu)
+{
+	static unsigned int nr_insts;
+
+	/* Instances of a library with the same name would share its copy,
+	   several benches run the same configuration.  */
+	snprintf(bi->name, sizeof bi->name, "%s-%u", name, nr_insts++);
+	bi->hooks = hooks;
+	tlmu_init(&bi->q, bi->name);
+	if (tlmu_load(&bi->q, soname)) {
+		printf("failed to load %s\n", soname);
+		return 1;
+	}
+
+	tlmu_append_arg(&bi->q, "-M");
+	tlmu_append_arg(&bi->q, "tlm-mach");
+	tlmu_append_arg(&bi->q, "-icount");
+	tlmu_append_arg(&bi->q, "1");
+	tlmu_append_arg(&bi->q, "-cpu");
+	tlmu_append_arg(&bi->q, cpu);
+
+	tlmu_set_opaque(&bi->q, bi);
+	tlmu_set_bus_access_cb(&bi->q, inst_bus_access);
+	tlmu_set_bus_access_dbg_cb(&bi->q, inst_bus_access_dbg);
+	tlmu_set_bus_get_dmi_ptr_cb(&bi->q, inst_get_dmi_ptr);
+	tlmu_set_sync_cb(&bi->q, inst_sync);
+	tlmu_set_sync_period_ns(&bi->q, 100 * 1000ULL);
+	tlmu_set_boot_state(&bi->q, TLMU_BOOT_RUNNING);
+	return 0;
+}
+
+static void *inst_thread(void *p)
+{
+	struct bench_inst *bi = p;
+
+	tlmu_run(&bi->q);
+	return NULL;
+}
+
+static void inst_start(struct bench_inst *bi)
+{
+	pthread_create(&bi->tid, NULL, inst_thread, bi);
+}
+
+static void inst_run(struct bench_inst *bi)
+{
+	inst_start(bi);
+	pthread_join(bi->tid, NULL);
+}
+
+/*
+ * DMA bench memory map:
+ *   0x00000000 64KB code RAM, reads as zeros (nops on ARM).
+ *   0x19000000 1MB RAM mapped with tlmu_map_ram as two 512KB RAMs.
+ *   0x20000000 Bus device behind the TLMu core's main TLM area.
+ */
+#define DMA_RAM_BASE  0x19000000ULL
+#define DMA_RAM_SIZE  (1024 * 1024)
+#define DMA_RAM_HALF  (DMA_RAM_BASE + DMA_RAM_SIZE / 2)
+#define DMA_MMIO_BASE 0x20000000ULL
+#define DMA_LEN       4096
+#define DMA_ROUNDS    2048
+
+struct dma_bench {
+	struct bench_inst bi;
+	unsigned char ram[DMA_RAM_SIZE];
+	unsigned char mmio[DMA_RAM_SIZE];
+	uint64_t nr_access;
+	/* Accesses spanning both RAMs, bursts have to be split there.  */
+	uint64_t nr_straddle;
+	int done;
+	int err;
+};
+
+static int dma_bus_access(void *o, int rw, uint64_t addr, void *data, int len)
+{
+	struct dma_bench *b = o;
+	unsigned char *mem = NULL;
+
+	b->nr_access++;
+	if (addr >= DMA_RAM_BASE && addr + len <= DMA_RAM_BASE + DMA_RAM_SIZE) {
+		mem = &b->ram[addr - DMA_RAM_BASE];
+		if (addr < DMA_RAM_HALF && addr + len > DMA_RAM_HALF)
+			b->nr_straddle++;
+	} else if (addr >= DMA_MMIO_BASE
+		   && addr + len <= DMA_MMIO_BASE + DMA_RAM_SIZE) {
+		mem = &b->mmio[addr - DMA_MMIO_BASE];
+	}
+
+	if (!mem) {
+		if (!rw)
+			memset(data, 0, len);
+	} else if (rw) {
+		memcpy(mem, data, len);
+	} else {
+		memcpy(data, mem, len);
+	}
+	return 0;
+}
+
+/*
+ * Writes store the same DMA_LEN pattern all over mem, the reads that
+ * follow have to return it.
+ */
+static int dma_run(struct dma_bench *b, const char *what, uint64_t base,
+		unsigned char *mem, int burst, int rw)
+{
+	unsigned char buf[DMA_LEN];
+	int64_t start, end;
+	uint64_t nr_access;
+	int i, j;
+
+	for (j = 0; j < DMA_LEN; j++)
+		buf[j] = rw ? j * 7 + burst : 0;
+	nr_access = b->nr_access;
+	start = now_ns();
+	for (i = 0; i < DMA_ROUNDS; i++) {
+		uint64_t addr = base + (i * DMA_LEN) % DMA_RAM_SIZE;
+
+		if (burst) {
+			tlmu_bus_access_burst(&b->bi.q, rw, addr, buf, DMA_LEN);
+			continue;
+		}
+		for (j = 0; j < DMA_LEN; j += 4) {
+			tlmu_bus_access(&b->bi.q, rw, addr + j, buf + j, 4);
+		}
+	}
+	end = now_ns();
+
+	printf("dma: %-4s %-5s %-6s %8.1f MB/s %6.1f callbacks/xfer\n",
+		what, rw ? "write" : "read", burst ? "burst" : "word",
+		(double) DMA_ROUNDS * DMA_LEN / ((end - start) / 1e3),
+		(double) (b->nr_access - nr_access) / DMA_ROUNDS);
+
+	for (j = 0; j < DMA_RAM_SIZE; j += DMA_LEN) {
+		if (memcmp(mem + j, buf, DMA_LEN)) {
+			printf("dma: %s %s data differs at %#x\n",
+				what, rw ? "write" : "read", j);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* A burst across the two RAMs has to reach each through its own access.  */
+static int dma_split(struct dma_bench *b)
+{
+	unsigned char buf[DMA_LEN], back[DMA_LEN];
+	uint64_t addr = DMA_RAM_HALF - DMA_LEN / 2;
+	int i;
+
+	for (i = 0; i < DMA_LEN; i++)
+		buf[i] = i * 3;
+	memset(back, 0, sizeof back);
+	tlmu_bus_access_burst(&b->bi.q, 1, addr, buf, DMA_LEN);
+	tlmu_bus_access_burst(&b->bi.q, 0, addr, back, DMA_LEN);
+
+	if (b->nr_straddle) {
+		printf("dma: burst not split between RAMs\n");
+		return 1;
+	}
+	if (memcmp(&b->ram[addr - DMA_RAM_BASE], buf, DMA_LEN)
+	    || memcmp(back, buf, DMA_LEN)) {
+		printf("dma: burst across RAMs corrupted\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* Run the DMA tests from the first sync, with the core in a sane state.  */
+static void dma_sync(void *o, int64_t time_ns)
+{
+	struct dma_bench *b = o;
+	int rw, burst;
+
+	if (b->done)
+		return;
+	b->done = 1;
+
+	for (rw = 1; rw >= 0 && !b->err; rw--) {
+		for (burst = 0; burst < 2 && !b->err; burst++) {
+			b->err |= dma_run(b, "ram", DMA_RAM_BASE, b->ram,
+					burst, rw);
+			b->err |= dma_run(b, "mmio", DMA_MMIO_BASE, b->mmio,
+					burst, rw);
+		}
+	}
+	if (!b->err)
+		b->err = dma_split(b);
+	tlmu_exit(&b->bi.q);
+}
+
+static const struct bench_hooks dma_hooks = {
+	.bus_access = dma_bus_access,
+	.sync = dma_sync,
+};
+
+static int bench_dma(int argc, char **argv)
+{
+	struct dma_bench *b;
+
+	b = calloc(1, sizeof *b);
+	if (inst_setup(&b->bi, &dma_hooks, "dma", "libtlmu-arm.so", "arm926"))
+		return 1;
+
+	tlmu_map_ram(&b->bi.q, "code", 0, 64 * 1024, 1);
+	tlmu_map_ram(&b->bi.q, "ram0", DMA_RAM_BASE, DMA_RAM_SIZE / 2, 1);
+	tlmu_map_ram(&b->bi.q, "ram1", DMA_RAM_HALF, DMA_RAM_SIZE / 2, 1);
+
+	inst_run(&b->bi);
+	return b->err;
+}
+
+/*
+ * Sync bench guest, runs from a code RAM at 0 and counts its loops in
+ * the first word of the device:
+ *
+ *     mov  r1, #0x20000000
+ * 1:  ldr  r0, [r1]
+ *     add  r0, r0, #1
+ *     str  r0, [r1]
+ *     b    1b
+ *
+ * 0x20000000 is behind the core's main TLM area and grants DMI.
+ */
+#define SYNC_RUN_NS (200 * 1000 * 1000LL)
+
+/* A loop is 4 insns, 8ns with -icount 1.  */
+#define SYNC_LOOP_NS 8
+
+#define IRQ_PERIOD 16
+
+enum {
+	IRQ_EVENT = 1,
+	IRQ_SET,
+};
+
+static const uint32_t sync_guest[] = {
+	0xe3a01202, 0xe5910000, 0xe2800001, 0xe5810000, 0xeafffffb,
+};
+
+struct sync_bench {
+	struct bench_inst bi;
+	uint32_t dev[1024];
+	uint64_t nr_sync;
+	int64_t start;
+	int64_t end;
+	/* Emulated time of the last sync.  */
+	int64_t time_ns;
+
+	/* Toggle IRQ 0 on every IRQ_PERIOD syncs, see irq_run.  */
+	int irq;
+	int irq_level;
+};
+
+static int sync_bus_access(void *o, int rw, uint64_t addr, void *data, int len)
+{
+	struct sync_bench *b = o;
+
+	if (!rw)
+		memset(data, 0, len);
+	return addr >= DMA_MMIO_BASE
+		&& addr < DMA_MMIO_BASE + sizeof b->dev;
+}
+
+static void sync_get_dmi_ptr(void *o, uint64_t addr, struct tlmu_dmi *dmi)
+{
+	struct sync_bench *b = o;
+
+	if (addr >= DMA_MMIO_BASE && addr < DMA_MMIO_BASE + sizeof b->dev) {
+		dmi->ptr = b->dev;
+		dmi->base = DMA_MMIO_BASE;
+		dmi->size = sizeof b->dev;
+		dmi->prot = TLMU_DMI_PROT_READ | TLMU_DMI_PROT_WRITE;
+	}
+}
+
+static void sync_sync(void *o, int64_t time_ns)
+{
+	struct sync_bench *b = o;
+
+	b->nr_sync++;
+	b->time_ns = time_ns;
+	if (b->irq && b->nr_sync % IRQ_PERIOD == 0) {
+		b->irq_level ^= 1;
+		if (b->irq == IRQ_EVENT) {
+			struct tlmu_irq qirq = { 0, b->irq_level };
+
+			tlmu_notify_event(&b->bi.q, TLMU_TLM_EVENT_IRQ, &qirq);
+		} else {
+			tlmu_set_irq(&b->bi.q, 0, b->irq_level);
+		}
+	}
+	if (time_ns >= SYNC_RUN_NS) {
+		b->end = now_ns();
+		tlmu_exit(&b->bi.q);
+	}
+}
+
+static const struct bench_hooks sync_hooks = {
+	.bus_access = sync_bus_access,
+	.get_dmi_ptr = sync_get_dmi_ptr,
+	.sync = sync_sync,
+};
+
+static int sync_setup(struct sync_bench *b, const char *name, int decoupled)
+{
+	if (inst_setup(&b->bi, &sync_hooks, name, "libtlmu-arm.so", "arm926"))
+		return 1;
+	b->bi.code = sync_guest;
+	b->bi.code_size = sizeof sync_guest;
+	tlmu_set_sync_decoupled(&b->bi.q, decoupled);
+
+	tlmu_map_ram(&b->bi.q, "code", 0, 64 * 1024, 1);
+	return 0;
+}
+
+/*
+ * The guest has to have counted the loops that fit in the emulated time
+ * of the last sync, give or take a sync period.
+ */
+static int sync_check(struct sync_bench *b)
+{
+	int64_t loops = b->time_ns / SYNC_LOOP_NS;
+	int64_t slack = 100 * 1000 / SYNC_LOOP_NS;
+
+	if (b->dev[0] < loops - slack || b->dev[0] > loops + slack) {
+		printf("%s: guest counted %u loops in %.1f ms, expected %"
+			PRId64 "\n", b->bi.name, b->dev[0], b->time_ns / 1e6,
+			loops);
+		return 1;
+	}
+	return 0;
+}
+
+static int sync_run(int decoupled, uint64_t *nr_sync)
+{
+	struct sync_bench *b;
+	char name[32];
+	double us;
+
+	b = calloc(1, sizeof *b);
+	snprintf(name, sizeof name, "sync%d", decoupled);
+	if (sync_setup(b, name, decoupled))
+		return 1;
+
+	b->start = now_ns();
+	inst_run(&b->bi);
+
+	/* -icount 1 means 2ns per insn.  */
+	us = (b->end - b->start) / 1e3;
+	printf("sync: %-9s %10.0f syncs/s %8.1f MIPS\n",
+		decoupled ? "decoupled" : "coupled",
+		b->nr_sync / (us / 1e6), SYNC_RUN_NS / 2 / us);
+	*nr_sync = b->nr_sync;
+	return sync_check(b);
+}
+
+static int bench_sync(int argc, char **argv)
+{
+	uint64_t coupled, decoupled;
+
+	if (sync_run(0, &coupled) || sync_run(1, &decoupled))
+		return 1;
+	/* Every DMI access to the device syncs unless decoupled.  */
+	if (decoupled >= coupled) {
+		printf("sync: decoupled run made %" PRIu64 " syncs, coupled %"
+			PRIu64 "\n", decoupled, coupled);
+		return 1;
+	}
+	return 0;
+}
+
+/* The IRQ stays masked by the guest, only the delivery gets measured.  */
+static int irq_run(int mode, int sync)
+{
+	struct sync_bench *b;
+	char name[32];
+	double us;
+
+	b = calloc(1, sizeof *b);
+	snprintf(name, sizeof name, "irq%d%d", mode, sync);
+	if (sync_setup(b, name, 0))
+		return 1;
+	b->irq = mode;
+	tlmu_set_irq_sync(&b->bi.q, sync);
+
+	b->start = now_ns();
+	inst_run(&b->bi);
+
+	us = (b->end - b->start) / 1e3;
+	printf("irq: %-13s %-4s %10.0f irqs/s %8.1f MIPS\n",
+		mode == IRQ_EVENT ? "notify_event" : "set_irq",
+		sync ? "sync" : "bh",
+		b->nr_sync / IRQ_PERIOD / (us / 1e6), SYNC_RUN_NS / 2 / us);
+	return sync_check(b);
+}
+
+static int bench_irq(int argc, char **argv)
+{
+	return irq_run(IRQ_EVENT, 0) || irq_run(IRQ_EVENT, 1)
+		|| irq_run(IRQ_SET, 1);
+}
+
+/*
+ * The parallel run stops at the quantum edge past PAR_RUN_NS, before the
+ * sync guests stop by themselves.
+ */
+#define PAR_RUN_NS (50 * 1000 * 1000LL)
+#define PAR_QUANTUM_NS (100 * 1000LL)
+#define PAR_MAX 4
+
+static int par_exchange(void *o, int64_t time_ns)
+{
+	unsigned int *nr_quanta = o;
+
+	(*nr_quanta)++;
+	return time_ns >= PAR_RUN_NS;
+}
+
+static int par_run(int n)
+{
+	struct sync_bench *b[PAR_MAX];
+	struct tlmu *q[PAR_MAX];
+	unsigned int nr_quanta = 0;
+	char name[32];
+	int64_t start;
+	double us;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		b[i] = calloc(1, sizeof *b[i]);
+		snprintf(name, sizeof name, "par%d-%d", n, i);
+		if (sync_setup(b[i], name, 1))
+			return 1;
+		q[i] = &b[i]->bi.q;
+	}
+
+	start = now_ns();
+	if (tlmu_run_parallel(q, n, PAR_QUANTUM_NS, par_exchange, &nr_quanta))
+		return 1;
+	us = (now_ns() - start) / 1e3;
+
+	printf("parallel: %d instances %8.1f ms %8.1f MIPS %u quanta\n",
+		n, us / 1e3, n * PAR_RUN_NS / 2 / us, nr_quanta);
+	for (i = 0; i < n; i++) {
+		if (sync_check(b[i]))
+			return 1;
+	}
+	return 0;
+}
+
+static int bench_parallel(int argc, char **argv)
+{
+	return par_run(1) || par_run(2) || par_run(PAR_MAX);
+}
+
+/*
+ * The rams guest loads one word from each of the 64 pages at RAMS_BASE,
+ * over and over. The pages are mapped as 1, 8 or 64 TLM RAMs that grant
+ * DMI, so the cost is dominated by finding the RAM behind each access.
+ * The ramptr test backs the RAMs with host memory instead. The snapshot
+ * test saves an instance half way and runs the rest from the snapshot.
+ *
+ *	mov	r1, #0x10000000
+ *	mov	r2, #64
+ * 1:	ldr	r0, [r1]
+ *	add	r1, r1, #0x1000
+ *	subs	r2, r2, #1
+ *	bne	1b
+ *	b	0
+ */
+#define RAMS_BASE   0x10000000ULL
+#define RAMS_SPAN   (64 * 4096)
+#define RAMS_RUN_NS (100 * 1000 * 1000LL)
+
+static const uint32_t rams_guest[] = {
+	0xe3a01201, 0xe3a02040, 0xe5910000, 0xe2811a01,
+	0xe2522001, 0x1afffffb, 0xeafffff8,
+};
+
+enum {
+	RAMS_PROF	= 1,
+	RAMS_TRACE	= 2,
+	RAMS_TRACE_MEM	= 3,
+	RAMS_PTR	= 4,
+	RAMS_SNAP_SAVE	= 5,
+	RAMS_SNAP_LOAD	= 6,
+};
+
+static const char *rams_mode_name[] = {
+	"rams", "prof", "trace", "memtrace", "ramptr", "snapsave", "snapload"
+};
+
+#define RAMS_SNAP_FILE ".tlmu/bench.snap"
+
+struct rams_bench {
+	struct bench_inst bi;
+	unsigned char mem[RAMS_SPAN];
+	int nr_rams;
+	int mode;
+	int64_t end;
+	/* Emulated time the run starts from, non-zero after a restore.  */
+	int64_t start_ns;
+	/* Host time when the snapshot got requested and how long it took.  */
+	int64_t snap_req;
+	int64_t snap_ns;
+};
+
+static int rams_bus_access(void *o, int rw, uint64_t addr, void *data, int len)
+{
+	struct rams_bench *b = o;
+
+	if (addr >= RAMS_BASE && addr + len <= RAMS_BASE + RAMS_SPAN) {
+		if (rw)
+			memcpy(&b->mem[addr - RAMS_BASE], data, len);
+		else
+			memcpy(data, &b->mem[addr - RAMS_BASE], len);
+		return 1;
+	}
+
+	if (!rw)
+		memset(data, 0, len);
+	return 0;
+}
+
+static void rams_get_dmi_ptr(void *o, uint64_t addr, struct tlmu_dmi *dmi)
+{
+	struct rams_bench *b = o;
+	uint64_t size = RAMS_SPAN / b->nr_rams;
+	uint64_t base;
+
+	if (addr >= RAMS_BASE && addr < RAMS_BASE + RAMS_SPAN) {
+		base = addr - (addr - RAMS_BASE) % size;
+		dmi->ptr = &b->mem[base - RAMS_BASE];
+		dmi->base = base;
+		dmi->size = size;
+		dmi->prot = TLMU_DMI_PROT_READ | TLMU_DMI_PROT_WRITE;
+	}
+}
+
+static void rams_sync(void *o, int64_t time_ns)
+{
+	struct rams_bench *b = o;
+
+	if (b->mode == RAMS_SNAP_SAVE) {
+		if (!b->snap_req && time_ns >= RAMS_RUN_NS / 2) {
+			b->snap_req = now_ns();
+			if (tlmu_snapshot_save(&b->bi.q, RAMS_SNAP_FILE))
+				b->snap_ns = -1;
+		} else if (b->snap_req && !b->snap_ns
+			   && tlmu_snapshot_status(&b->bi.q) != 1) {
+			b->snap_ns = now_ns() - b->snap_req;
+		}
+	}
+	if (b->mode == RAMS_SNAP_LOAD && !b->start_ns) {
+		b->start_ns = time_ns;
+	}
+
+	if (time_ns >= RAMS_RUN_NS) {
+		b->end = now_ns();
+		tlmu_exit(&b->bi.q);
+	}
+}
+
+static const struct bench_hooks rams_hooks = {
+	.bus_access = rams_bus_access,
+	.get_dmi_ptr = rams_get_dmi_ptr,
+	.sync = rams_sync,
+};
+
+static int rams_run(int nr_rams, int mode)
+{
+	struct rams_bench *b;
+	char name[32];
+	int64_t start;
+	uint64_t size = RAMS_SPAN / nr_rams;
+	int i;
+
+	b = calloc(1, sizeof *b);
+	b->nr_rams = nr_rams;
+	b->mode = mode;
+	/* The restore has to bring the contents back.  */
+	if (mode == RAMS_SNAP_SAVE) {
+		for (i = 0; i < RAMS_SPAN; i++)
+			b->mem[i] = i * 7;
+	}
+	snprintf(name, sizeof name, "%s%d", rams_mode_name[mode], nr_rams);
+	if (inst_setup(&b->bi, &rams_hooks, name, "libtlmu-arm.so", "arm926"))
+		return 1;
+	b->bi.code = rams_guest;
+	b->bi.code_size = sizeof rams_guest;
+
+	tlmu_set_tb_prof(&b->bi.q, mode == RAMS_PROF);
+	if (mode == RAMS_TRACE || mode == RAMS_TRACE_MEM) {
+		/* Bus accesses only, one in 16.  */
+		if (mode == RAMS_TRACE_MEM) {
+			tlmu_trace_set_exec(&b->bi.q, 0);
+			tlmu_trace_set_mem(&b->bi.q, 16);
+		}
+		if (tlmu_trace_start(&b->bi.q, ".tlmu/bench.trace", 0))
+			return 1;
+	}
+
+	/* TLMu keeps copies of the RAM names.  */
+	tlmu_map_ram(&b->bi.q, "code", 0, 64 * 1024, 1);
+	for (i = 0; i < nr_rams; i++) {
+		snprintf(name, sizeof name, "ram%d", i);
+		if (mode == RAMS_PTR) {
+			/* Backed by b->mem, no bus accesses nor DMI.  */
+			tlmu_map_ram_ptr(&b->bi.q, name,
+				RAMS_BASE + i * size, size, 1,
+				&b->mem[i * size]);
+		} else {
+			tlmu_map_ram(&b->bi.q, name, RAMS_BASE + i * size,
+				size, 1);
+		}
+	}
+
+	if (mode == RAMS_SNAP_LOAD)
+		tlmu_snapshot_load(&b->bi.q, RAMS_SNAP_FILE);
+
+	start = now_ns();
+	inst_run(&b->bi);
+
+	/* -icount 1 means 2ns per insn.  */
+	printf("%s: %2d RAMs %8.1f MIPS\n", rams_mode_name[mode], nr_rams,
+		(RAMS_RUN_NS - b->start_ns) / 2 / ((b->end - start) / 1e3));
+	if (mode == RAMS_SNAP_SAVE) {
+		if (b->snap_ns <= 0 || tlmu_snapshot_status(&b->bi.q))
+			return 1;
+		printf("%s: saved at %.1f ms in %.1f ms\n",
+			rams_mode_name[mode], RAMS_RUN_NS / 2 / 1e6,
+			b->snap_ns / 1e6);
+	}
+	if (mode == RAMS_SNAP_LOAD) {
+		for (i = 0; i < RAMS_SPAN; i++) {
+			if (b->mem[i] != (unsigned char) (i * 7)) {
+				printf("%s: RAM contents not restored\n",
+					rams_mode_name[mode]);
+				return 1;
+			}
+		}
+		printf("%s: resumed at %.1f ms\n", rams_mode_name[mode],
+			b->start_ns / 1e6);
+	}
+	if (mode == RAMS_PROF
+	    && tlmu_tb_prof_dump(&b->bi.q, ".tlmu/bench.prof"))
+		return 1;
+	if ((mode == RAMS_TRACE || mode == RAMS_TRACE_MEM)
+	    && tlmu_trace_stop(&b->bi.q))
+		return 1;
+	return 0;
+}
+
+static int bench_rams(int argc, char **argv)
+{
+	return rams_run(1, 0) || rams_run(8, 0) || rams_run(64, 0);
+}
+
+static int bench_prof(int argc, char **argv)
+{
+	return rams_run(8, 0) || rams_run(8, RAMS_PROF);
+}
+
+static int bench_trace(int argc, char **argv)
+{
+	return rams_run(8, 0) || rams_run(8, RAMS_TRACE)
+		|| rams_run(8, RAMS_TRACE_MEM);
+}
+
+static int bench_ramptr(int argc, char **argv)
+{
+	return rams_run(8, 0) || rams_run(8, RAMS_PTR);
+}
+
+static int bench_snapshot(int argc, char **argv)
+{
+	return rams_run(8, RAMS_SNAP_SAVE) || rams_run(8, RAMS_SNAP_LOAD);
+}
+
+/*
+ * The c_example guests, each run to its STOP write on the c_example
+ * memory map: a magic device at 0x10500000, ROM at 0x18000000 and RAM
+ * at 0x19000000, 128KB each. With several cores, each core gets a RAM
+ * of its own and the run ends once all of them wrote STOP.
+ */
+#define XLAT_MAX_CPUS 8
+#define XLAT_HELLO    "Hello, I am the "
+
+struct xlat_bench {
+	struct bench_inst bi;
+	int ncpus;
+	/* The cores that wrote STOP, their exit codes and what they put.  */
+	unsigned int stopped;
+	uint32_t ec[XLAT_MAX_CPUS];
+	char out[XLAT_MAX_CPUS][32];
+	unsigned int out_len[XLAT_MAX_CPUS];
+	unsigned char rom[128 * 1024];
+	unsigned char ram[XLAT_MAX_CPUS][128 * 1024];
+};
+
+static int xlat_bus_access(void *o, int rw, uint64_t addr, void *data, int len)
+{
+	struct xlat_bench *b = o;
+	unsigned char *mem = NULL;
+	int cpu = 0;
+
+	/* Accesses that don't come from a core go to the first RAM.  */
+	if (b->ncpus > 1 && tlmu_current_cpu(&b->bi.q) >= 0)
+		cpu = tlmu_current_cpu(&b->bi.q);
+
+	if (addr >= 0x10500000 && addr < 0x10500100) {
+		if (!rw) {
+			memset(data, 0, len);
+			return 0;
+		}
+		/* Offset 4 is putchar, offsets above 4 are STOP.  */
+		if (addr - 0x10500000 == 4) {
+			if (b->out_len[cpu] < sizeof b->out[cpu] - 1)
+				b->out[cpu][b->out_len[cpu]++] =
+					*(uint32_t *) data;
+		} else if (addr - 0x10500000 > 4) {
+			b->ec[cpu] = *(uint32_t *) data;
+			b->stopped |= 1 << cpu;
+			if (b->stopped == (1U << b->ncpus) - 1)
+				tlmu_exit(&b->bi.q);
+		}
+		return 0;
+	}
+
+	if (addr >= 0x18000000 && addr + len <= 0x18000000 + sizeof b->rom)
+		mem = &b->rom[addr - 0x18000000];
+	if (addr >= 0x19000000 && addr + len <= 0x19000000 + sizeof b->ram[0])
+		mem = &b->ram[cpu][addr - 0x19000000];
+	if (!mem) {
+		if (!rw)
+			memset(data, 0, len);
+		return 0;
+	}
+
+	if (rw)
+		memcpy(mem, data, len);
+	else
+		memcpy(data, mem, len);
+	return 1;
+}
+
+static const struct bench_hooks xlat_hooks = {
+	.bus_access = xlat_bus_access,
+};
+
+static struct xlat_bench *xlat_load(const char *name, const char *soname,
+			const char *cpu, const char *image, int ncpus)
+{
+	struct xlat_bench *b;
+	char smp[8];
+
+	b = calloc(1, sizeof *b);
+	b->ncpus = ncpus;
+	if (inst_setup(&b->bi, &xlat_hooks, name, soname, cpu)) {
+		free(b);
+		return NULL;
+	}
+
+	tlmu_append_arg(&b->bi.q, "-kernel");
+	tlmu_append_arg(&b->bi.q, image);
+	if (ncpus > 1) {
+		snprintf(smp, sizeof smp, "%d", ncpus);
+		tlmu_append_arg(&b->bi.q, "-smp");
+		tlmu_append_arg(&b->bi.q, smp);
+	}
+
+	tlmu_map_ram(&b->bi.q, "rom", 0x18000000ULL, 128 * 1024, 0);
+	tlmu_map_ram(&b->bi.q, "ram", 0x19000000ULL, 128 * 1024, 1);
+	return b;
+}
+
+/* Every core has to have greeted and stopped with exit code 0.  */
+static int xlat_check(struct xlat_bench *b)
+{
+	int i;
+
+	for (i = 0; i < b->ncpus; i++) {
+		if (!(b->stopped & (1 << i)) || b->ec[i]
+		    || strncmp(b->out[i], XLAT_HELLO, strlen(XLAT_HELLO))
+		    || b->out[i][b->out_len[i] - 1] != '\n') {
+			printf("%s: core %d stopped %d with %u after \"%s\"\n",
+				b->bi.name, i, !!(b->stopped & (1 << i)),
+				b->ec[i], b->out[i]);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Run the instances to completion and print their summed counters.  */
+static int xlat_run_all(const char *desc, struct xlat_bench **b, int n)
+{
+	struct tlmu_stats st;
+	uint64_t tbs = 0, translate_ns = 0;
+	int64_t start, end;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		inst_start(&b[i]->bi);
+	for (i = 0; i < n; i++)
+		pthread_join(b[i]->bi.tid, NULL);
+	end = now_ns();
+
+	for (i = 0; i < n; i++) {
+		tlmu_get_stats(&b[i]->bi.q, &st);
+		tbs += st.tbs_translated;
+		translate_ns += st.translate_ns;
+	}
+	printf("%-16s %7.2f ms, %5" PRIu64 " TBs translated in %6.2f ms\n",
+		desc, (end - start) / 1e6, tbs, translate_ns / 1e6);
+
+	for (i = 0; i < n; i++) {
+		if (xlat_check(b[i]))
+			return 1;
+	}
+	return 0;
+}
+
+static int xlat_run(const char *soname, const char *cpu, const char *image)
+{
+	struct xlat_bench *b;
+
+	b = xlat_load(cpu, soname, cpu, image, 1);
+	if (!b)
+		return 1;
+	return xlat_run_all(cpu, &b, 1);
+}
+
+static int bench_translate(int argc, char **argv)
+{
+	return xlat_run("libtlmu-arm.so", "arm926", "arm-guest/guest")
+		|| xlat_run("libtlmu-cris.so", "crisv10", "cris-guest/guest")
+		|| xlat_run("libtlmu-mipsel.so", "24Kc", "mipsel-guest/guest");
+}
+
+static int bench_cluster(int argc, char **argv)
+{
+	struct xlat_bench *b[XLAT_MAX_CPUS];
+	char name[32];
+	int i;
+
+	for (i = 0; i < XLAT_MAX_CPUS; i++) {
+		snprintf(name, sizeof name, "arm926-%d", i);
+		b[i] = xlat_load(name, "libtlmu-arm.so", "arm926",
+				"arm-guest/guest", 1);
+		if (!b[i])
+			return 1;
+	}
+	if (xlat_run_all("8 instances", b, XLAT_MAX_CPUS))
+		return 1;
+
+	b[0] = xlat_load("arm926-smp", "libtlmu-arm.so", "arm926",
+			"arm-guest/guest", XLAT_MAX_CPUS);
+	if (!b[0])
+		return 1;
+	return xlat_run_all("1 x 8 cores", b, 1);
+}
+
+/*
+ * A guest made of TBSIZE_NR_BLOCKS blocks run in a loop, too much code
+ * for a 1MB translation buffer. The first block points r2 at a result
+ * register, the last one stores the count of blocks run so far:
+ *
+ * 0:	mov	r2, #0x20000000
+ *	b	1f
+ * 1:	add	r0, r0, #1
+ *	b	2f
+ *	...
+ *	str	r0, [r2]
+ *	b	0b
+ *
+ * The jmpcache test uses the same number of blocks but with indirect
+ * jumps, so that every block goes through the jump cache. The last
+ * block stores its own address:
+ *
+ * 0:	mov	r2, #0x20000000
+ *	mov	r1, #8
+ * 1:	add	r1, r1, #8
+ *	mov	pc, r1
+ *	...
+ *	str	r1, [r2]
+ *	b	0b
+ */
+#define TBSIZE_NR_BLOCKS (16 * 1024)
+#define TBSIZE_RUN_NS    (10 * 1000 * 1000LL)
+#define TBSIZE_RESULT    0x20000000ULL
+
+struct tbsize_bench {
+	struct bench_inst bi;
+	uint32_t code[TBSIZE_NR_BLOCKS * 2];
+	int indirect;
+	/* Results stored by the guest and the ones that were wrong.  */
+	uint64_t nr_results;
+	uint64_t nr_bad;
+	int64_t end;
+	double mips;
+	struct tlmu_stats st;
+};
+
+static int tbsize_bus_access(void *o, int rw, uint64_t addr, void *data,
+			int len)
+{
+	struct tbsize_bench *b = o;
+	uint32_t expect;
+
+	if (!rw) {
+		memset(data, 0, len);
+		return 0;
+	}
+	if (addr == TBSIZE_RESULT) {
+		b->nr_results++;
+		if (b->indirect)
+			expect = (TBSIZE_NR_BLOCKS - 1) * 8;
+		else
+			expect = b->nr_results * (TBSIZE_NR_BLOCKS - 2);
+		if (*(uint32_t *) data != expect)
+			b->nr_bad++;
+	}
+	return 0;
+}
+
+static void tbsize_sync(void *o, int64_t time_ns)
+{
+	struct tbsize_bench *b = o;
+
+	if (time_ns >= TBSIZE_RUN_NS) {
+		b->end = now_ns();
+		tlmu_exit(&b->bi.q);
+	}
+}
+
+static const struct bench_hooks tbsize_hooks = {
+	.bus_access = tbsize_bus_access,
+	.sync = tbsize_sync,
+};
+
+static struct tbsize_bench *tbsize_load(const char *name, int indirect)
+{
+	struct tbsize_bench *b;
+	int i;
+
+	b = calloc(1, sizeof *b);
+	b->indirect = indirect;
+	for (i = 0; i < TBSIZE_NR_BLOCKS; i++) {
+		b->code[i * 2] = indirect ? 0xe2811008 : 0xe2800001;
+		b->code[i * 2 + 1] = indirect ? 0xe1a0f001 : 0xeaffffff;
+	}
+	b->code[0] = 0xe3a02202;
+	if (indirect)
+		b->code[1] = 0xe3a01008;
+	/* Store the result and go back to 0 from the last block.  */
+	b->code[i * 2 - 2] = indirect ? 0xe5821000 : 0xe5820000;
+	b->code[i * 2 - 1] = 0xea000000 | ((-(i * 2 - 1) - 2) & 0xffffff);
+
+	if (inst_setup(&b->bi, &tbsize_hooks, name, "libtlmu-arm.so",
+			"arm926")) {
+		free(b);
+		return NULL;
+	}
+	b->bi.code = b->code;
+	b->bi.code_size = sizeof b->code;
+	tlmu_map_ram(&b->bi.q, "code", 0, sizeof b->code, 0);
+	return b;
+}
+
+static int tbsize_run(struct tbsize_bench *b)
+{
+	int64_t start;
+
+	start = now_ns();
+	inst_run(&b->bi);
+
+	/* -icount 1 means 2ns per insn.  */
+	b->mips = TBSIZE_RUN_NS / 2 / ((b->end - start) / 1e3);
+	tlmu_get_stats(&b->bi.q, &b->st);
+
+	if (!b->nr_results || b->nr_bad) {
+		printf("%s: %" PRIu64 " of %" PRIu64 " guest results wrong\n",
+			b->bi.name, b->nr_bad, b->nr_results);
+		return 1;
+	}
+	return 0;
+}
+
+static int tbsize_buf(uint64_t size, uint64_t max_size)
+{
+	struct tbsize_bench *b;
+	char name[32];
+
+	snprintf(name, sizeof name, "tbsize%" PRIu64, max_size);
+	b = tbsize_load(name, 0);
+	if (!b)
+		return 1;
+	tlmu_set_tb_size(&b->bi.q, size, max_size);
+	if (tbsize_run(b))
+		return 1;
+
+	printf("%3" PRIu64 "MB up to %3" PRIu64 "MB %8.1f MIPS, %4" PRIu64
+		" flushes, %" PRIu64 " grows, %6.1f MB translated\n",
+		size >> 20, (max_size > size ? max_size : size) >> 20,
+		b->mips, b->st.tb_flushes, b->st.tb_grows,
+		b->st.translated_bytes / 1e6);
+	if (max_size > size && !b->st.tb_grows) {
+		printf("%s: translation buffer never grew\n", name);
+		return 1;
+	}
+	return 0;
+}
+
+static int bench_tbsize(int argc, char **argv)
+{
+	return tbsize_buf(1 << 20, 0) || tbsize_buf(1 << 20, 64 << 20);
+}
+
+static int jmpcache_run(unsigned int bits, uint64_t *misses)
+{
+	struct tbsize_bench *b;
+	char name[32];
+
+	snprintf(name, sizeof name, "jmpcache%u", bits);
+	b = tbsize_load(name, 1);
+	if (!b)
+		return 1;
+	tlmu_set_jmp_cache_bits(&b->bi.q, bits);
+	if (tbsize_run(b))
+		return 1;
+
+	printf("%2u bits %8.1f MIPS, %5.1f%% misses, %4.2f probes/miss,"
+		" %" PRIu64 " hash grows\n", bits, b->mips,
+		100.0 * b->st.jmp_cache_misses / b->st.jmp_cache_lookups,
+		(double) b->st.tb_hash_probes / b->st.jmp_cache_misses,
+		b->st.tb_hash_grows);
+	*misses = b->st.jmp_cache_misses;
+	return 0;
+}
+
+static int bench_jmpcache(int argc, char **argv)
+{
+	uint64_t small, large;
+
+	if (jmpcache_run(12, &small) || jmpcache_run(16, &large))
+		return 1;
+	/* All 16K blocks fit in the larger cache but not in the smaller.  */
+	if (large >= small) {
+		printf("jmpcache: %" PRIu64 " misses with 64K entries, %"
+			PRIu64 " with 4K\n", large, small);
+		return 1;
+	}
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(int argc, char **argv);
+} benches[] = {
+	{"startup", bench_startup},
+	{"dma", bench_dma},
+	{"sync", bench_sync},
+	{"irq", bench_irq},
+	{"parallel", bench_parallel},
+	{"rams", bench_rams},
+	{"prof", bench_prof},
+	{"trace", bench_trace},
+	{"ramptr", bench_ramptr},
+	{"snapshot", bench_snapshot},
+	{"translate", bench_translate},
+	{"cluster", bench_cluster},
+	{"tbsize", bench_tbsize},
+	{"jmpcache", bench_jmpcache},
+	{NULL, NULL}
+};
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	for (i = 0; benches[i].name; i++) {
+		if (argc < 2 || !strcmp(argv[1], benches[i].name)) {
+			if (benches[i].run(argc > 2 ? argc - 2 : 0, argv + 2))
+				return 1;
+		}
+	}
+	return 0;
+}
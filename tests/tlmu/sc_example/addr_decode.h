@@ -0,0 +1,127 @@
+/*
+ * Address decoder for interconnect models
+ *
+ * Copyright (c) 2011 Edgar E. Iglesias.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdint.h>
+
+/*
+ * Maps addresses to the id of the range holding them. Ranges are kept
+ * sorted by address and may not overlap, so a lookup is a binary search.
+ * Each initiator has a last hit slot that gets checked first, which
+ * catches most accesses since initiators tend to stay on the same slave.
+ */
+template<unsigned int N_RANGES, unsigned int N_INITIATORS>
+class addr_decode
+{
+public:
+	addr_decode(void);
+
+	/* Returns false if the range overlaps an existing one.  */
+	bool insert(uint64_t addr, uint64_t size, int id);
+	/* Returns the id of the range holding addr, -1 if there is none.  */
+	int lookup(unsigned int initiator, uint64_t addr);
+
+private:
+	struct range {
+		uint64_t addr;
+		uint64_t size;
+		int id;
+	} r[N_RANGES];
+	unsigned int nr;
+
+	unsigned int last_hit[N_INITIATORS];
+
+	bool hit(unsigned int i, uint64_t addr) {
+		return i < nr && addr - r[i].addr < r[i].size;
+	}
+};
+
+template<unsigned int N_RANGES, unsigned int N_INITIATORS>
+addr_decode<N_RANGES, N_INITIATORS>::addr_decode(void)
+	: nr(0)
+{
+	unsigned int i;
+
+	for (i = 0; i < N_INITIATORS; i++) {
+		last_hit[i] = 0;
+	}
+}
+
+template<unsigned int N_RANGES, unsigned int N_INITIATORS>
+bool addr_decode<N_RANGES, N_INITIATORS>::insert(uint64_t addr,
+		uint64_t size, int id)
+{
+	unsigned int i, pos;
+
+	if (nr == N_RANGES || size == 0 || addr + size - 1 < addr) {
+		return false;
+	}
+
+	for (pos = 0; pos < nr && r[pos].addr < addr; pos++)
+		;
+
+	if (pos > 0 && r[pos - 1].addr + r[pos - 1].size > addr) {
+		return false;
+	}
+	if (pos < nr && addr + size > r[pos].addr) {
+		return false;
+	}
+
+	for (i = nr; i > pos; i--) {
+		r[i] = r[i - 1];
+	}
+	r[pos].addr = addr;
+	r[pos].size = size;
+	r[pos].id = id;
+	nr++;
+
+	/* The slots may now point to other ranges, which is harmless.  */
+	return true;
+}
+
+template<unsigned int N_RANGES, unsigned int N_INITIATORS>
+int addr_decode<N_RANGES, N_INITIATORS>::lookup(unsigned int initiator,
+		uint64_t addr)
+{
+	unsigned int lo = 0, hi = nr, mid;
+
+	if (hit(last_hit[initiator], addr)) {
+		return r[last_hit[initiator]].id;
+	}
+
+	/* Find the last range starting at or below addr.  */
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (r[mid].addr <= addr) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (!hit(lo, addr)) {
+		return -1;
+	}
+	last_hit[initiator] = lo;
+	return r[lo].id;
+}
@@ -0,0 +1,134 @@
+/*
+ * Micro benchmark for the interconnect address decoder
+ *
+ * Copyright (c) 2011 Edgar E. Iglesias.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Compares the sorted range decoder used by iconnect with the linear map
+ * scan it replaced, for 64 slaves of 64KB and two access patterns: runs
+ * of 16 accesses to the same slave and uniformly random slaves.
+ * Doesn't need SystemC.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "addr_decode.h"
+
+#define NR_SLAVES 64
+#define SLAVE_SIZE (64 * 1024)
+#define NR_ADDRS (1024 * 1024)
+#define NR_LOOPS 16
+
+static struct {
+	uint64_t addr;
+	uint64_t size;
+} map[NR_SLAVES * 4];
+
+static addr_decode<NR_SLAVES * 4, 1> decoder;
+static uint64_t addrs[NR_ADDRS];
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int linear_lookup(uint64_t addr)
+{
+	unsigned int i;
+
+	for (i = 0; i < NR_SLAVES * 4; i++) {
+		if (map[i].size
+		    && addr >= map[i].addr
+		    && addr < map[i].addr + map[i].size)
+			return i;
+	}
+	return -1;
+}
+
+static void run(const char *pattern)
+{
+	int64_t start, t_linear, t_sorted;
+	unsigned int i, loop;
+	unsigned long sum = 0;
+
+	start = now_ns();
+	for (loop = 0; loop < NR_LOOPS; loop++) {
+		for (i = 0; i < NR_ADDRS; i++)
+			sum += linear_lookup(addrs[i]);
+	}
+	t_linear = now_ns() - start;
+
+	start = now_ns();
+	for (loop = 0; loop < NR_LOOPS; loop++) {
+		for (i = 0; i < NR_ADDRS; i++)
+			sum -= decoder.lookup(0, addrs[i]);
+	}
+	t_sorted = now_ns() - start;
+
+	if (sum) {
+		printf("decoders disagree!\n");
+		exit(1);
+	}
+
+	printf("%-7s linear %6.1f ns/decode sorted %6.1f ns/decode\n",
+		pattern, (double) t_linear / (NR_LOOPS * NR_ADDRS),
+		(double) t_sorted / (NR_LOOPS * NR_ADDRS));
+}
+
+int main(void)
+{
+	unsigned int i, slave = 0;
+
+	/* Map the slaves in a scattered order, like a real SoC.  */
+	for (i = 0; i < NR_SLAVES; i++) {
+		map[i].addr = 0x40000000ULL + ((i * 37) % NR_SLAVES) * 0x100000;
+		map[i].size = SLAVE_SIZE;
+		if (!decoder.insert(map[i].addr, map[i].size, i)) {
+			printf("insert failed\n");
+			return 1;
+		}
+	}
+	if (decoder.insert(map[0].addr + 4, 4, 0)) {
+		printf("overlap not detected\n");
+		return 1;
+	}
+
+	srand(1);
+	for (i = 0; i < NR_ADDRS; i++) {
+		if (i % 16 == 0)
+			slave = rand() % NR_SLAVES;
+		addrs[i] = map[slave].addr + (rand() % SLAVE_SIZE & ~3);
+	}
+	run("runs");
+
+	for (i = 0; i < NR_ADDRS; i++) {
+		slave = rand() % NR_SLAVES;
+		addrs[i] = map[slave].addr + (rand() % SLAVE_SIZE & ~3);
+	}
+	run("random");
+	return 0;
+}
@@ -22,6 +22,8 @@
  * THE SOFTWARE.
  */
 
+#include "addr_decode.h"
+
 /*
  * To differentiate between targets that want to be passed absolute
  * addresses with every transaction. Most targets or slaves will use
@@ -71,10 +73,14 @@ public:
 	int memmap(sc_dt::uint64 addr, sc_dt::uint64 size,
 		enum addrmode addrmode, int idx, tlm::tlm_target_socket<> &s);
 private:
-	unsigned int map_address(sc_dt::uint64 addr, sc_dt::uint64& offset);
+	unsigned int map_address(int id, sc_dt::uint64 addr,
+				sc_dt::uint64& offset);
 	void unmap_offset(unsigned int target_nr,
 				sc_dt::uint64 offset, sc_dt::uint64& addr);
 
+	/* Maps addresses to map entries.  */
+	addr_decode<N_TARGETS * 4, N_INITIATORS> decoder;
+
 };
 
 template<unsigned int N_INITIATORS, unsigned int N_TARGETS>
@@ -116,6 +122,12 @@ int iconnect<N_INITIATORS, N_TARGETS>::memmap(
 	for (i = 0; i < N_TARGETS * 4; i++) {
 		if (map[i].size == 0) {
 			/* Found a free entry.  */
+			if (!decoder.insert(addr, size, i)) {
+				printf("FATAL! mapping %lx-%lx overlaps or "
+					"is empty!\n", (unsigned long) addr,
+					(unsigned long) (addr + size - 1));
+				abort();
+			}
 			map[i].addr = addr;
 			map[i].size = size;
 			map[i].addrmode = addrmode;
@@ -133,23 +145,20 @@ int iconnect<N_INITIATORS, N_TARGETS>::memmap(
 }
 
 template<unsigned int N_INITIATORS, unsigned int N_TARGETS>
-unsigned int iconnect<N_INITIATORS, N_TARGETS>::map_address(
+unsigned int iconnect<N_INITIATORS, N_TARGETS>::map_address(int id,
 			sc_dt::uint64 addr,
 			sc_dt::uint64& offset)
 {
-	unsigned int i;
-
-	for (i = 0; i < N_TARGETS * 4; i++) {
-		if (map[i].size
-		    && addr >= map[i].addr
-		    && addr <= (map[i].addr + map[i].size)) {
-			if (map[i].addrmode == ADDRMODE_RELATIVE) {
-				offset = addr - map[i].addr;
-			} else {
-				offset = addr;
-			}
-			return map[i].sk_idx;
+	int i;
+
+	i = decoder.lookup(id, addr);
+	if (i >= 0) {
+		if (map[i].addrmode == ADDRMODE_RELATIVE) {
+			offset = addr - map[i].addr;
+		} else {
+			offset = addr;
 		}
+		return map[i].sk_idx;
 	}
 
 	/* Did not find any slave !?!?  */
@@ -193,7 +202,7 @@ void iconnect<N_INITIATORS, N_TARGETS>::b_transport(int id,
 	}
 
 	addr = trans.get_address();
-	target_nr = map_address(addr, offset);
+	target_nr = map_address(id, addr, offset);
 
 	trans.set_address(offset);
 	/* Forward the transaction.  */
@@ -217,7 +226,7 @@ bool iconnect<N_INITIATORS, N_TARGETS>::get_direct_mem_ptr(int id,
 	}
 
 	addr = trans.get_address();
-	target_nr = map_address(addr, offset);
+	target_nr = map_address(id, addr, offset);
 
 	trans.set_address(offset);
 	/* Forward the transaction.  */
@@ -243,7 +252,7 @@ unsigned int iconnect<N_INITIATORS, N_TARGETS>::transport_dbg(int id,
 	}
 
 	addr = trans.get_address();
-	target_nr = map_address(addr, offset);
+	target_nr = map_address(id, addr, offset);
 
 	trans.set_address(offset);
 	/* Forward the transaction.  */
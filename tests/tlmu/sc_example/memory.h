@@ -34,6 +34,7 @@ public:
 	virtual bool get_direct_mem_ptr(tlm::tlm_generic_payload& trans,
                                   tlm::tlm_dmi& dmi_data);
 	virtual unsigned int transport_dbg(tlm::tlm_generic_payload& trans);
+	uint8_t *get_ptr(void) { return mem; }
 
 private:
 	uint8_t *mem;
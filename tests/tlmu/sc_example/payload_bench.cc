@@ -0,0 +1,120 @@
+/*
+ * Micro benchmark for generic payload setup on the TLMu bus paths
+ *
+ * Copyright (c) 2011 Edgar E. Iglesias.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Makes 32bit b_transport reads into a memory model, once with a payload
+ * built from scratch per access as tlmu_sc::bus_access used to do, and
+ * once with a reused payload where only the per access fields get set.
+ */
+
+#define SC_INCLUDE_DYNAMIC_PROCESSES
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "tlm_utils/simple_initiator_socket.h"
+#include "tlm_utils/simple_target_socket.h"
+
+using namespace sc_core;
+using namespace std;
+
+#include "memory.h"
+
+#define NR_ACCESSES (10 * 1000 * 1000)
+
+SC_MODULE(Bench)
+{
+	tlm_utils::simple_initiator_socket<Bench> socket;
+
+	SC_CTOR(Bench) : socket("socket") {
+		SC_THREAD(run);
+	}
+
+	void access_fresh(uint64_t addr, void *data, int len) {
+		tlm::tlm_generic_payload tr;
+		sc_time delay = SC_ZERO_TIME;
+
+		tr.set_command(tlm::TLM_READ_COMMAND);
+		tr.set_address(addr);
+		tr.set_data_ptr((unsigned char *)data);
+		tr.set_data_length(len);
+		tr.set_streaming_width(len);
+		tr.set_dmi_allowed(false);
+		tr.set_response_status(tlm::TLM_INCOMPLETE_RESPONSE);
+		socket->b_transport(tr, delay);
+	}
+
+	void access_reused(uint64_t addr, void *data, int len) {
+		sc_time delay = SC_ZERO_TIME;
+
+		tr.set_command(tlm::TLM_READ_COMMAND);
+		tr.set_address(addr);
+		tr.set_data_ptr((unsigned char *)data);
+		tr.set_data_length(len);
+		tr.set_streaming_width(len);
+		tr.set_dmi_allowed(false);
+		tr.set_response_status(tlm::TLM_INCOMPLETE_RESPONSE);
+		socket->b_transport(tr, delay);
+	}
+
+	void run(void) {
+		uint32_t data;
+		double t;
+		int i;
+
+		t = now();
+		for (i = 0; i < NR_ACCESSES; i++) {
+			access_fresh((i * 4) & 0xfff, &data, 4);
+		}
+		t = now() - t;
+		printf("fresh payload  %10.0f accesses/s\n", NR_ACCESSES / t);
+
+		t = now();
+		for (i = 0; i < NR_ACCESSES; i++) {
+			access_reused((i * 4) & 0xfff, &data, 4);
+		}
+		t = now() - t;
+		printf("reused payload %10.0f accesses/s\n", NR_ACCESSES / t);
+	}
+
+private:
+	tlm::tlm_generic_payload tr;
+
+	static double now(void) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec + ts.tv_nsec / 1e9;
+	}
+};
+
+int sc_main(int argc, char* argv[])
+{
+	Bench *bench = new Bench("bench");
+	memory *mem = new memory("mem", SC_ZERO_TIME, 4096);
+
+	bench->socket.bind(mem->socket);
+	sc_start();
+	return 0;
+}
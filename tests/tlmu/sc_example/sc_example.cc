@@ -25,6 +25,7 @@
 #define SC_INCLUDE_DYNAMIC_PROCESSES
 
 #include <inttypes.h>
+#include <string.h>
 
 #include "tlm_utils/simple_initiator_socket.h"
 #include "tlm_utils/simple_target_socket.h"
@@ -58,7 +59,12 @@ SC_MODULE(Top)
 	memory  *mem[2];
 	magicdev *magic;
 
-	Top(sc_module_name name) :
+	/*
+	 * host_ram shares the memory models' buffers with the CPUs so that
+	 * RAM accesses run at native speed. They then bypass the bus and
+	 * the memories' access delays.
+	 */
+	Top(sc_module_name name, bool host_ram) :
 #if NR_CPUS >= 2
 		to_arm_sk("toarm"),
 		to_arm_irq_sk("toarm_irq"),
@@ -128,7 +134,8 @@ SC_MODULE(Top)
 					ADDRMODE_RELATIVE, -1, mem[i]->socket);
 			for (j = 0; j < NR_CPUS; j++) {
 				cpu[j]->map_ram(rams[i].name,
-					rams[i].base, rams[i].size, rams[i].rw);
+					rams[i].base, rams[i].size, rams[i].rw,
+					host_ram ? mem[i]->get_ptr() : NULL);
 			}
 		}
 
@@ -156,10 +163,17 @@ private:
 int sc_main(int argc, char* argv[])
 {
 	Top *top;
+	bool host_ram = false;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-host-ram"))
+			host_ram = true;
+	}
 
 	sc_set_time_resolution(1, SC_NS);
 
-	top = new Top("top");
+	top = new Top("top", host_ram);
 	sc_start();
 	return 0;
 }
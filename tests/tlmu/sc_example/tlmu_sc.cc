@@ -23,6 +23,7 @@
  */
 
 #define SC_INCLUDE_DYNAMIC_PROCESSES
+#define __STDC_FORMAT_MACROS
 
 #include <inttypes.h>
 #include <sys/utsname.h>
@@ -56,12 +57,18 @@ tlmu_sc::tlmu_sc(sc_module_name name, const char *soname,
 	  elf_filename(elf_filename),
 	  tracing(tracing),
 	  gdb_conn(gdb_conn),
-	  is_running(false)
+	  is_running(false),
+	  max_posted(0),
+	  nr_posted(0),
+	  req_in_flight(NULL),
+	  posted_writes(0),
+	  posted_stalls(0)
 {
 	int err;
 
 	from_tlmu_sk.register_invalidate_direct_mem_ptr(this,
 			&tlmu_sc::invalidate_direct_mem_ptr);
+	from_tlmu_sk.register_nb_transport_bw(this, &tlmu_sc::nb_transport_bw);
 
 	/* Accesses from System-C TLM into TLMu bus.  */
 	to_tlmu_sk.register_b_transport(this, &tlmu_sc::to_tlmu_b_transport);
@@ -104,6 +111,53 @@ void tlmu_sc::start_of_simulation(void)
 	m_qk.reset();
 }
 
+void tlmu_sc::end_of_simulation(void)
+{
+	struct tlmu_stats st;
+
+	tlmu_get_stats(&q, &st);
+	printf("%s: bus accesses %" PRIu64 " dmi hits %" PRIu64
+		" misses %" PRIu64 " grants %" PRIu64
+		" invalidations %" PRIu64 " line hits %" PRIu64 "\n",
+		name(), st.bus_accesses, st.dmi_hits, st.dmi_misses,
+		st.dmi_grants, st.dmi_invalidations, st.line_hits);
+	printf("%s: syncs %" PRIu64 " tb exits %" PRIu64
+		" tbs translated %" PRIu64 " in %.3f ms\n",
+		name(), st.syncs, st.tb_exits, st.tbs_translated,
+		st.translate_ns / 1e6);
+	printf("%s: tb flushes %" PRIu64 " grows %" PRIu64
+		" translated bytes %" PRIu64 "\n",
+		name(), st.tb_flushes, st.tb_grows, st.translated_bytes);
+	printf("%s: jmp cache lookups %" PRIu64 " misses %" PRIu64
+		" hash probes %" PRIu64 "\n",
+		name(), st.jmp_cache_lookups, st.jmp_cache_misses,
+		st.tb_hash_probes);
+	if (max_posted) {
+		printf("%s: posted writes %" PRIu64 " stalls %" PRIu64 "\n",
+			name(), posted_writes, posted_stalls);
+	}
+
+	if (tracing & TRACING_PROF) {
+		char *filename;
+
+		if (asprintf(&filename, ".tlmu/%s.prof", name()) > 0) {
+			tlmu_tb_prof_dump(&q, filename);
+			free(filename);
+		}
+	}
+	if (tracing & (TRACING_EXEC | TRACING_MEM)) {
+		tlmu_trace_stop(&q);
+	}
+	if (tracing & TRACING_COV) {
+		char *filename;
+
+		if (asprintf(&filename, ".tlmu/%s.cov", name()) > 0) {
+			tlmu_cov_dump(&q, filename);
+			free(filename);
+		}
+	}
+}
+
 void tlmu_sc::set_image_load_params(uint64_t base, uint64_t size)
 {
 	tlmu_set_image_load_params(&q, base, size);
@@ -131,22 +185,53 @@ void tlmu_sc::sync_time(int64_t tlmu_time_ns)
 	}
 }
 
+/*
+ * Get a payload for an access from TLMu. Only the per access fields get
+ * set, the others keep their defaults.
+ */
+tlm::tlm_generic_payload *tlmu_sc::bus_tr_get(int rw, uint64_t addr,
+					void *data, int len)
+{
+	tlm::tlm_generic_payload *tr = trs.get();
+
+	tr->acquire();
+	tr->set_command(rw ? tlm::TLM_WRITE_COMMAND : tlm::TLM_READ_COMMAND);
+	tr->set_address(addr);
+	tr->set_data_ptr((unsigned char *)data);
+	tr->set_data_length(len);
+	tr->set_streaming_width(len);
+	tr->set_byte_enable_ptr(NULL);
+	tr->set_byte_enable_length(0);
+	tr->set_dmi_allowed(false);
+	tr->set_response_status(tlm::TLM_INCOMPLETE_RESPONSE);
+	return tr;
+}
+
+void tlmu_sc::bus_tr_put(tlm::tlm_generic_payload *tr)
+{
+	tr->release();
+}
+
 void tlmu_sc::get_dmi_ptr(uint64_t addr, struct tlmu_dmi *dmi)
 {
-	tlm::tlm_generic_payload tr;
+	tlm::tlm_generic_payload *tr;
 	tlm::tlm_dmi dmi_data;
 	bool r;
 
+	/* Don't let TLMu read around writes still on their way.  */
+	drain_posted_writes();
+
 	dmi_data.init();
-	tr.set_address(addr);
-	r = from_tlmu_sk->get_direct_mem_ptr(tr, dmi_data);
+	tr = bus_tr_get(0, addr, NULL, 0);
+	r = from_tlmu_sk->get_direct_mem_ptr(*tr, dmi_data);
+	bus_tr_put(tr);
 	if (r) {
 		sc_time latency;
 		double l;
 
 		dmi->ptr = dmi_data.get_dmi_ptr();
 		dmi->base = dmi_data.get_start_address();
-		dmi->size = dmi_data.get_end_address() - dmi->base;
+		dmi->size = dmi_data.get_end_address() - dmi->base + 1;
 		dmi->prot = TLMU_DMI_PROT_NONE;
 
 		if (dmi_data.is_read_allowed()) {
@@ -180,50 +265,176 @@ void tlmu_sc::invalidate_direct_mem_ptr(sc_dt::uint64 start,
 int tlmu_sc::bus_access(int64_t clk, int rw,
 			uint64_t addr, void *data, int len)
 {
-	tlm::tlm_generic_payload tr;
+	tlm::tlm_generic_payload *tr;
 	sc_time delay;
+	int dmi_allowed;
 
 #if 0
 	printf("%s: rw=%d addr=%lx len=%d data=%x\n", __func__,
 			rw, addr, len, *(uint32_t *)data);
 #endif
-	tr.set_command(rw ? tlm::TLM_WRITE_COMMAND : tlm::TLM_READ_COMMAND );
-	tr.set_address(addr);
-	tr.set_data_ptr((unsigned char *)data);
-	tr.set_data_length(len);
-	tr.set_streaming_width(len);
-	tr.set_dmi_allowed(false);
-	tr.set_response_status(tlm::TLM_INCOMPLETE_RESPONSE);
-
 	/* Sync the QEMU time with TLM to let the target see the elapsed
 	   time from CPU execution.  */
 	sync_time(clk);
+
+	if (max_posted) {
+		if (rw && len <= POSTED_WR_MAX_LEN) {
+			post_write(addr, data, len);
+			return 0;
+		}
+		/* Reads and large writes get ordered after posted writes.  */
+		drain_posted_writes();
+	}
+
+	tr = bus_tr_get(rw, addr, data, len);
 	delay = m_qk.get_local_time();
-	from_tlmu_sk->b_transport(tr, delay);
+	from_tlmu_sk->b_transport(*tr, delay);
 
-	if (tr.get_response_status() != tlm::TLM_OK_RESPONSE) {
+	if (tr->get_response_status() != tlm::TLM_OK_RESPONSE) {
 		tlmu_notify_event(&q, TLMU_TLM_EVENT_DEBUG_BREAK, 0);
 	}
+	dmi_allowed = tr->is_dmi_allowed();
+	bus_tr_put(tr);
 
 	m_qk.set_and_sync(delay);
-	return tr.is_dmi_allowed();
+	return dmi_allowed;
 }
 
 void tlmu_sc::bus_access_dbg(int64_t clk, int rw,
 				uint64_t addr, void *data, int len)
 {
-	tlm::tlm_generic_payload tr;
+	tlm::tlm_generic_payload *tr;
 
 	//printf("%s: rw=%d addr=%lx len=%d\n", __func__, rw, addr, len);
-	tr.set_command(rw ? tlm::TLM_WRITE_COMMAND : tlm::TLM_READ_COMMAND );
-	tr.set_address(addr);
-	tr.set_data_ptr((unsigned char *)data);
-	tr.set_data_length(len);
-	tr.set_streaming_width(len);
-	tr.set_dmi_allowed(false);
-	tr.set_response_status(tlm::TLM_INCOMPLETE_RESPONSE);
+	tr = bus_tr_get(rw, addr, data, len);
+	from_tlmu_sk->transport_dbg(*tr);
+	bus_tr_put(tr);
+}
+
+/*
+ * Post a write from TLMu. The CPU only waits when the previous request
+ * hasn't been accepted yet or when too many writes are outstanding.
+ */
+void tlmu_sc::post_write(uint64_t addr, void *data, int len)
+{
+	tlm::tlm_phase phase = tlm::BEGIN_REQ;
+	tlm::tlm_sync_enum r;
+	pooled_tr *tr;
+	sc_time delay;
+
+	while (req_in_flight || nr_posted >= max_posted) {
+		posted_stalls++;
+		m_qk.sync();
+		if (req_in_flight) {
+			wait(end_req_event);
+		} else {
+			wait(posted_done_event);
+		}
+	}
+
+	tr = trs.get();
+	memcpy(tr->buf, data, len);
+	tr->set_command(tlm::TLM_WRITE_COMMAND);
+	tr->set_address(addr);
+	tr->set_data_ptr(tr->buf);
+	tr->set_data_length(len);
+	tr->set_streaming_width(len);
+	tr->set_byte_enable_ptr(NULL);
+	tr->set_byte_enable_length(0);
+	tr->set_dmi_allowed(false);
+	tr->set_response_status(tlm::TLM_INCOMPLETE_RESPONSE);
+	tr->acquire();
+	nr_posted++;
+	posted_writes++;
 
-	from_tlmu_sk->transport_dbg(tr);
+	delay = m_qk.get_local_time();
+	r = from_tlmu_sk->nb_transport_fw(*tr, phase, delay);
+	switch (r) {
+	case tlm::TLM_ACCEPTED:
+		req_in_flight = tr;
+		break;
+	case tlm::TLM_UPDATED:
+		/* On END_REQ the response comes on the backward path.  */
+		if (phase == tlm::BEGIN_RESP) {
+			phase = tlm::END_RESP;
+			delay = SC_ZERO_TIME;
+			from_tlmu_sk->nb_transport_fw(*tr, phase, delay);
+			posted_write_done(tr);
+		}
+		break;
+	case tlm::TLM_COMPLETED:
+		posted_write_done(tr);
+		break;
+	}
+}
+
+void tlmu_sc::posted_write_done(tlm::tlm_generic_payload *trans)
+{
+	if (trans->is_response_error()) {
+		tlmu_notify_event(&q, TLMU_TLM_EVENT_DEBUG_BREAK, 0);
+	}
+	nr_posted--;
+	posted_done_event.notify(SC_ZERO_TIME);
+	trans->release();
+}
+
+void tlmu_sc::drain_posted_writes(void)
+{
+	while (nr_posted) {
+		posted_stalls++;
+		m_qk.sync();
+		wait(posted_done_event);
+	}
+}
+
+tlm::tlm_sync_enum tlmu_sc::nb_transport_bw(tlm::tlm_generic_payload& trans,
+					tlm::tlm_phase& phase, sc_time& delay)
+{
+	/* BEGIN_RESP implies END_REQ.  */
+	if (&trans == req_in_flight
+	    && (phase == tlm::END_REQ || phase == tlm::BEGIN_RESP)) {
+		req_in_flight = NULL;
+		end_req_event.notify(delay);
+	}
+
+	if (phase == tlm::BEGIN_RESP) {
+		posted_write_done(&trans);
+		phase = tlm::END_RESP;
+		return tlm::TLM_COMPLETED;
+	}
+	return tlm::TLM_ACCEPTED;
+}
+
+tlmu_sc::tr_pool::~tr_pool(void)
+{
+	while (head) {
+		pooled_tr *tr = head;
+
+		head = tr->next;
+		delete tr;
+	}
+}
+
+tlmu_sc::pooled_tr *tlmu_sc::tr_pool::get(void)
+{
+	pooled_tr *tr = head;
+
+	if (tr) {
+		head = tr->next;
+	} else {
+		tr = new pooled_tr(this);
+	}
+	return tr;
+}
+
+/* Called by the payload when the last reference to it goes.  */
+void tlmu_sc::tr_pool::free(tlm::tlm_generic_payload *trans)
+{
+	pooled_tr *tr = static_cast<pooled_tr *>(trans);
+
+	tr->reset();
+	tr->next = head;
+	head = tr;
 }
 
 bool tlmu_sc::to_tlmu_get_direct_mem_ptr(tlm::tlm_generic_payload& trans,
@@ -274,7 +485,6 @@ void tlmu_sc::to_tlmu_b_transport(tlm::tlm_generic_payload& trans, sc_time& dela
 	unsigned int wid = trans.get_streaming_width();
 	int is_ram = 0;
 	int rw;
-	unsigned int i;
 
 	if (be != NULL) {
 		trans.set_response_status(tlm::TLM_BYTE_ENABLE_ERROR_RESPONSE);
@@ -287,10 +497,7 @@ void tlmu_sc::to_tlmu_b_transport(tlm::tlm_generic_payload& trans, sc_time& dela
 
 	rw = cmd == tlm::TLM_WRITE_COMMAND;
 
-	for (i = 0; i<len; i+=4) {
-		int l = len-i > 4 ? 4: len-i;
-		is_ram = tlmu_bus_access(&q, rw, addr + i, data + i, l);
-	}
+	is_ram = tlmu_bus_access_burst(&q, rw, addr, data, len);
 	if (is_ram) {
 		trans.set_dmi_allowed(true);
 	}
@@ -326,10 +533,19 @@ void tlmu_sc::irq_b_transport(tlm::tlm_generic_payload& trans, sc_time& delay)
 	tlmu_notify_event(&q, TLMU_TLM_EVENT_IRQ, &qirq);
 }
 
-void tlmu_sc::map_ram(const char *name, uint64_t base, uint64_t size, int rw)
+/*
+ * Map a RAM. With host set, TLMu uses that memory directly instead of
+ * making transactions on from_tlmu_sk for the area.
+ */
+void tlmu_sc::map_ram(const char *name, uint64_t base, uint64_t size, int rw,
+			void *host)
 {
 	sc_assert(!is_running);
-	tlmu_map_ram(&q, name, base, size, rw);
+	if (host) {
+		tlmu_map_ram_ptr(&q, name, base, size, rw, host);
+	} else {
+		tlmu_map_ram(&q, name, base, size, rw);
+	}
 }
 
 unsigned int tlmu_sc::irq_transport_dbg(tlm::tlm_generic_payload& trans)
@@ -381,6 +597,35 @@ void tlmu_sc::gdb(const char *gdb_conn, bool wait_for_gdb_at_start)
 		tlmu_append_arg(&q, "-S");
 }
 
+/*
+ * Switch to approximately timed mode with up to max_posted_writes writes
+ * outstanding, 0 keeps the default loosely timed b_transport path.
+ * Reads that hit in read-only DMI regions aren't ordered against posted
+ * writes.
+ */
+void tlmu_sc::set_at_mode(unsigned int max_posted_writes)
+{
+	sc_assert(!is_running);
+	max_posted = max_posted_writes;
+}
+
+/* Start from a snapshot rather than booting.  */
+void tlmu_sc::snapshot_load(const char *filename)
+{
+	sc_assert(!is_running);
+	tlmu_snapshot_load(&q, filename);
+}
+
+/*
+ * Save a snapshot once the CPU reaches its next TB boundary. The
+ * contents of the RAMs on the TLM side are read with transport_dbg.
+ */
+int tlmu_sc::snapshot_save(const char *filename)
+{
+	this->wait_started();
+	return tlmu_snapshot_save(&q, filename);
+}
+
 void tlmu_sc::wait_started() {
 	if (!is_running) {
 		wait(start);
@@ -424,9 +669,25 @@ void tlmu_sc::process(void)
 	}
 
 	/* Debug.  */
-	if (tracing & TRACING_EXEC) {
-		tlmu_append_arg(&q, "-d");
-		tlmu_append_arg(&q, "in_asm,exec,cpu");
+	if (tracing & (TRACING_EXEC | TRACING_MEM)) {
+		char *filename;
+
+		tlmu_trace_set_exec(&q, tracing & TRACING_EXEC);
+		if (tracing & TRACING_MEM) {
+			tlmu_trace_set_mem(&q, 1);
+		}
+		if (asprintf(&filename, ".tlmu/%s.trace", name()) > 0) {
+			tlmu_trace_start(&q, filename, 0);
+			free(filename);
+		}
+	}
+	if (tracing & TRACING_PROF) {
+		tlmu_set_tb_prof(&q, 1);
+	}
+	if (tracing & TRACING_COV) {
+		/* The whole 32bit space, insn granular for 16bit insns.
+		   Only the pages touched get backed by memory.  */
+		tlmu_set_coverage(&q, NULL, 0, 1ULL << 32, 2);
 	}
 
 	/* Gdb stub.  */
@@ -40,7 +40,8 @@ public:
 		TRACING_OFF	= 0,
 		TRACING_EXEC	= 1,
 		TRACING_PROF	= 2,
-		TRACING_COV	= 4
+		TRACING_COV	= 4,
+		TRACING_MEM	= 8
 	};
 
 	tlm_utils::simple_initiator_socket<tlmu_sc> from_tlmu_sk;
@@ -59,10 +60,14 @@ public:
 		 int boot_state,
 		 int64_t sync_period_ns=-1);
 
-	void map_ram(const char *name, uint64_t base, uint64_t size, int rw);
+	void map_ram(const char *name, uint64_t base, uint64_t size, int rw,
+			void *host=NULL);
 	void set_image_load_params(uint64_t base, uint64_t size);
 	void append_arg(const char *newarg);
 	void gdb(const char *gdb_conn, bool wait_for_gdb_at_start=true);
+	void set_at_mode(unsigned int max_posted_writes);
+	void snapshot_load(const char *filename);
+	int snapshot_save(const char *filename);
 
 	void wake(void);
 	void sleep(void);
@@ -95,6 +100,7 @@ private:
 	virtual unsigned int irq_transport_dbg(tlm::tlm_generic_payload& trans);
 	void wait_started();
 	void start_of_simulation(void);
+	void end_of_simulation(void);
 	void process(void);
 	void sync_time(int64_t tlmu_time_ns);
 	void get_dmi_ptr(uint64_t addr, struct tlmu_dmi *dmi);
@@ -104,6 +110,53 @@ private:
 			uint64_t addr, void *data, int len);
 	void sync(int64_t time_ns);
 	int64_t last_sync;
+
+	/* Payloads for accesses from TLMu, reused rather than set up from
+	   scratch for every access. A payload goes back to the pool when
+	   the last reference to it is released, so accesses that overlap
+	   because a target waits and another process calls back into this
+	   instance never share one. Posted writes carry a copy of their
+	   data in buf.  */
+	enum { POSTED_WR_MAX_LEN = 64 };
+	class pooled_tr : public tlm::tlm_generic_payload {
+	public:
+		pooled_tr(tlm::tlm_mm_interface *mm)
+			: tlm::tlm_generic_payload(mm) {}
+		unsigned char buf[POSTED_WR_MAX_LEN];
+		pooled_tr *next;
+	};
+	class tr_pool : public tlm::tlm_mm_interface {
+	public:
+		tr_pool(void) : head(NULL) {}
+		~tr_pool(void);
+		pooled_tr *get(void);
+		void free(tlm::tlm_generic_payload *trans);
+	private:
+		pooled_tr *head;
+	};
+	tr_pool trs;
+	tlm::tlm_generic_payload *bus_tr_get(int rw, uint64_t addr,
+					void *data, int len);
+	void bus_tr_put(tlm::tlm_generic_payload *tr);
+
+	/* Approximately timed mode. Writes from TLMu get posted with
+	   nb_transport_fw and the CPU goes on without waiting for the
+	   response.  */
+	unsigned int max_posted;
+	unsigned int nr_posted;
+	/* The posted write still in its request phase, if any.  */
+	tlm::tlm_generic_payload *req_in_flight;
+	sc_core::sc_event end_req_event;
+	sc_core::sc_event posted_done_event;
+	uint64_t posted_writes;
+	uint64_t posted_stalls;
+
+	virtual tlm::tlm_sync_enum nb_transport_bw(
+					tlm::tlm_generic_payload& trans,
+					tlm::tlm_phase& phase, sc_time& delay);
+	void post_write(uint64_t addr, void *data, int len);
+	void posted_write_done(tlm::tlm_generic_payload *trans);
+	void drain_posted_writes(void);
 };
 
 extern "C" {
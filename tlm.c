@@ -1,5 +1,6 @@
 #include <inttypes.h>
 #include <stdlib.h>
+#include <sched.h>
 #include "tlmu-qemuif.h"
 
 /* The main SystemC opaque handler. Passed on most callbacks from QEMU to
@@ -37,8 +38,94 @@ int tlm_boot_state;
 uint64_t tlm_image_load_base = 0;
 uint64_t tlm_image_load_size = 0;
 
-int tlm_iodev_is_ram(int iodev) __attribute__((weak));
-int tlm_iodev_is_ram(int iodev)
+/* Lockstep quantum. When set, tlm_quantum_barrier gets called every
+   tlm_quantum_ns of emulated time, at the quantum edge.  */
+uint64_t tlm_quantum_ns = 0;
+void *tlm_quantum_opaque;
+void (*tlm_quantum_barrier)(void *o, int64_t time_ns);
+
+/* Non-zero to only sync on DMI accesses to non RAM areas once per sync
+   period, rather than on every access.  */
+int tlm_sync_decoupled = 0;
+
+/* Translation buffer size in bytes, zero for the QEMU default. If
+   tlm_tb_size_max is larger, a full buffer doubles up to that size
+   rather than getting flushed.  */
+uint64_t tlm_tb_size = 0;
+uint64_t tlm_tb_size_max = 0;
+
+/* Log2 of the number of jump cache entries per CPU, zero for the QEMU
+   default.  */
+unsigned int tlm_jmp_cache_bits = 0;
+
+/* Size of the line fills made on read misses to TLM RAMs without DMI.
+   Zero disables line fills.  */
+uint32_t tlm_line_size = 0;
+
+/* Non-zero to count executions per TB, see tlm_prof_dump.  */
+int tlm_prof = 0;
+
+/* Code coverage, marked as code gets translated. Disabled while the
+   bitmap is NULL.  */
+struct tlmu_cov tlm_cov;
+
+/* Execution trace ring, flushed by the TLMu library.  */
+struct tlmu_trace tlm_trace = {
+    .exec = 1,
+};
+
+/* Non-zero to deliver interrupts without going through a bottom half.  */
+int tlm_irq_sync = 0;
+/* Set when interrupts wait for the CPU to reach a TB boundary.  */
+int tlm_irq_pending = 0;
+
+/* Snapshot restored instead of booting, NULL for none.  */
+const char *tlm_snapshot_load_file = NULL;
+/* Result of the last tlm_snapshot_save, one while still pending.  */
+int tlm_snapshot_status = 0;
+
+/* Performance counters, read by tlmu_get_stats.  */
+struct tlmu_stats tlm_stats;
+
+/* The trace ring is full, let the consumer catch up.  */
+void tlm_trace_wait(void);
+void tlm_trace_wait(void)
+{
+    tlm_stats.trace_stalls++;
+    while (tlm_trace.head - tlm_trace.tail > tlm_trace.mask) {
+        sched_yield();
+    }
+}
+
+/* Non-zero if DMI areas on TLM RAMs should get mapped straight into the
+   softmmu TLB. Accesses to these areas will then bypass the TLM device.  */
+int tlm_dmi_tlb = 0;
+
+void *tlm_dmi_tlb_ptr(void *dev, uint64_t addr, uint64_t len, int write)
+    __attribute__((weak));
+void *tlm_dmi_tlb_ptr(void *dev, uint64_t addr, uint64_t len, int write)
+{
+    return NULL;
+}
+
+/* Called when a TLM RAM gets written behind the TLM device's back.  */
+void tlm_ram_written(void *dev, uint64_t addr, int len) __attribute__((weak));
+void tlm_ram_written(void *dev, uint64_t addr, int len)
+{
+}
+
+void tlm_irq_flush(void) __attribute__((weak));
+void tlm_irq_flush(void)
+{
+    tlm_irq_pending = 0;
+}
+
+/* Returns the number of bytes transferred, zero if the IO device doesn't
+   support bursts.  */
+int tlm_iodev_burst(int io_index, uint64_t addr, void *buf, int len,
+                    int is_write) __attribute__((weak));
+int tlm_iodev_burst(int io_index, uint64_t addr, void *buf, int len,
+                    int is_write)
 {
     return 0;
 }
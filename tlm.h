@@ -1,4 +1,5 @@
 #include "tlmu-qemuif.h"
+#include "qemu-barrier.h"
 
 extern void *tlm_opaque;
 extern int (*tlm_bus_access_cb)(void *o, int64_t clk, int rw,
@@ -11,6 +12,7 @@ extern void (*tlm_get_dmi_ptr_cb)(void *o, uint64_t addr,
 
 /* From SystemC into QEMU.  */
 extern int tlm_bus_access(int rw, uint64_t addr, void *data, int len);
+extern int tlm_bus_access_burst(int rw, uint64_t addr, void *data, int len);
 extern void tlm_bus_access_dbg(int rw, uint64_t addr, void *data, int len);
 extern int tlm_get_dmi_ptr(struct tlmu_dmi *dmi);
 extern void (*tlm_sync)(void *o, uint64_t time_ns);
@@ -22,14 +24,80 @@ extern void (*tlm_timer_start)(void *q, void *o,
 /* Used to map address areas as RAM. Needed by QEMU to allow code execution
    on these areas.  */
 void tlm_map_ram(const char *name, uint64_t addr, uint64_t size, int rw);
+/* Same but backed by host memory shared with the main emulator.  */
+void tlm_map_ram_ptr(const char *name, uint64_t addr, uint64_t size, int rw,
+                     void *host);
 void tlm_register_rams(void);
 
 extern uint64_t tlm_sync_period_ns;
+extern int tlm_sync_decoupled;
+
+extern uint64_t tlm_quantum_ns;
+extern void *tlm_quantum_opaque;
+extern void (*tlm_quantum_barrier)(void *o, int64_t time_ns);
+
+extern int tlm_irq_sync;
+extern int tlm_irq_pending;
+void tlm_irq_flush(void);
+void tlm_set_irq(int line, int level);
 
 extern void tlm_notify_event(enum tlmu_event ev, void *d);
+extern int tlm_notify_event_cpu(int cpu, enum tlmu_event ev, void *d);
+int tlm_current_cpu(void);
 
 /* Non-zero means running.  */
 extern int tlm_boot_state;
 
 extern uint64_t tlm_image_load_base;
 extern uint64_t tlm_image_load_size;
+
+extern int tlm_dmi_tlb;
+extern const char *tlm_snapshot_load_file;
+extern int tlm_snapshot_status;
+int tlm_snapshot_save(const char *filename);
+extern struct tlmu_stats tlm_stats;
+extern int tlm_prof;
+extern struct tlmu_cov tlm_cov;
+int tlm_prof_dump(const char *filename);
+extern uint32_t tlm_line_size;
+extern uint64_t tlm_tb_size;
+extern uint64_t tlm_tb_size_max;
+extern unsigned int tlm_jmp_cache_bits;
+
+extern struct tlmu_trace tlm_trace;
+void tlm_trace_wait(void);
+void tlm_trace_set_mem(unsigned int sample);
+
+/* Callers may check recs up front to skip the work, but only what we see
+   after raising busy counts. tlmu_trace_stop clears recs and then waits
+   for busy to drop before freeing the ring.  */
+static inline void tlm_trace_put(int type, int cpu, uint64_t icount,
+                                 uint64_t addr, uint32_t info)
+{
+    uint64_t head = tlm_trace.head;
+    struct tlmu_trace_rec *recs, *r;
+
+    tlm_trace.busy = 1;
+    __sync_synchronize();
+    recs = tlm_trace.recs;
+    if (!recs) {
+        tlm_trace.busy = 0;
+        return;
+    }
+
+    if (head - tlm_trace.tail > tlm_trace.mask) {
+        tlm_trace_wait();
+    }
+
+    r = &recs[head & tlm_trace.mask];
+    r->addr = addr;
+    r->icount = icount;
+    r->info = info;
+    r->type = type;
+    r->cpu = cpu;
+    /* Publish the record before moving head.  */
+    smp_wmb();
+    tlm_trace.head = head + 1;
+    barrier();
+    tlm_trace.busy = 0;
+}
@@ -38,3 +38,99 @@ struct tlmu_dmi
     unsigned int read_latency;   /* Read access delay.  */
     unsigned int write_latency;  /* Write access delay.  */
 };
+
+/*
+ * TB profile files start with TLMU_PROF_MAGIC, a uint32_t version and a
+ * uint32_t entry count, followed by the entries sorted by pc. All fields
+ * are in host byte order.
+ */
+#define TLMU_PROF_MAGIC "TLMUPROF"
+#define TLMU_PROF_VERSION 1
+
+struct tlmu_prof_entry
+{
+    uint64_t pc;                 /* Guest PC of the first insn.  */
+    uint32_t size;               /* Size of the guest code in bytes.  */
+    uint32_t insns;              /* Number of guest insns.  */
+    uint64_t count;              /* Number of executions.  */
+    uint64_t icount;             /* Guest insns executed.  */
+};
+
+/* Code coverage bitmap, one bit per 1 << granule_shift bytes of guest
+   code from base to base + size - 1.  */
+struct tlmu_cov
+{
+    uint8_t *bitmap;
+    uint64_t base;
+    uint64_t size;
+    uint32_t granule_shift;
+};
+
+/*
+ * Execution trace files start with TLMU_TRACE_MAGIC, a uint32_t version
+ * and a uint32_t record size, followed by struct tlmu_trace_rec records
+ * in execution order. All fields are in host byte order.
+ */
+#define TLMU_TRACE_MAGIC "TLMUTRAC"
+#define TLMU_TRACE_VERSION 1
+
+enum tlmu_trace_type {
+    TLMU_TRACE_TB = 0,           /* addr is the TB pc, info its insn count. */
+    TLMU_TRACE_MEM_READ = 1,     /* Guest bus accesses, info is the length */
+    TLMU_TRACE_MEM_WRITE = 2,    /* ORed with TLMU_TRACE_MEM_ flags.  */
+};
+
+#define TLMU_TRACE_MEM_DMI  (1U << 31)   /* Served by a DMI region.  */
+#define TLMU_TRACE_MEM_LINE (1U << 30)   /* Served by the line fill cache.  */
+
+struct tlmu_trace_rec
+{
+    uint64_t addr;
+    uint64_t icount;             /* Guest icount at the record, insns and
+                                    DMI latencies with -icount, traced
+                                    insns otherwise.  */
+    uint32_t info;
+    uint16_t type;               /* enum tlmu_trace_type.  */
+    uint16_t cpu;                /* CPU index.  */
+};
+
+/*
+ * Single producer, single consumer ring of trace records. The emulator
+ * writes at head, the consumer flushes from tail. Both are free running
+ * counters. Tracing is off while recs is NULL.
+ */
+struct tlmu_trace
+{
+    struct tlmu_trace_rec *recs;
+    uint32_t mask;               /* Number of records - 1, a power of 2.  */
+    volatile uint64_t head;
+    volatile uint64_t tail;
+    uint64_t icount;             /* Guest insns traced so far.  */
+    uint32_t exec;               /* Non-zero to trace TB executions.  */
+    uint32_t mem_sample;         /* Trace 1 in mem_sample bus accesses.  */
+    uint32_t mem_skip;           /* Bus accesses left to the next sample.  */
+    volatile uint32_t busy;      /* Set while the emulator uses recs.  */
+};
+
+struct tlmu_stats
+{
+    uint64_t bus_accesses;       /* Bus access callbacks.  */
+    uint64_t dmi_hits;           /* TLM accesses served by a DMI region.  */
+    uint64_t dmi_misses;         /* Bus accesses for lack of DMI.  */
+    uint64_t dmi_grants;         /* DMI regions granted.  */
+    uint64_t dmi_invalidations;  /* INVALIDATE_DMI events.  */
+    uint64_t line_hits;          /* Reads served by the line fill cache.  */
+    uint64_t syncs;              /* Sync callbacks.  */
+    uint64_t tb_exits;           /* Returns from the CPU loop.  */
+    uint64_t tbs_translated;     /* Translated blocks.  */
+    uint64_t trace_stalls;       /* Waits on a full trace ring.  */
+    uint64_t irq_updates;        /* Interrupt line level changes.  */
+    uint64_t translate_ns;       /* Host time spent translating code.  */
+    uint64_t translated_bytes;   /* Host code generated.  */
+    uint64_t tb_flushes;         /* Flushes of all translated code.  */
+    uint64_t tb_grows;           /* Code buffer growths, see tb_size_max.  */
+    uint64_t jmp_cache_lookups;  /* TB lookups by the CPU loop.  */
+    uint64_t jmp_cache_misses;   /* Lookups missing the jump cache.  */
+    uint64_t tb_hash_probes;     /* TBs visited in hash chains on misses.  */
+    uint64_t tb_hash_grows;      /* Doublings of the TB hash table.  */
+};
@@ -37,103 +37,148 @@
 #include <libgen.h>
 
 #include <pthread.h>
+#include <sched.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <fcntl.h>
+#include <linux/fs.h>
 
 #include <dlfcn.h>
 
 #include "tlmu.h"
 
-static timer_t tlmu_hosttimer;
+/*
+ * All instances in the process share one timer thread. Pending timers are
+ * kept in a binary min-heap ordered by expire time, protected by
+ * timer_mutex. The thread sleeps on timer_cond until the earliest deadline
+ * and gets woken up when a rearm changes the head of the heap.
+ */
 pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
-static struct tlmu_timer *timers = NULL;
-static const int64_t default_next_timer_check_ns = 1000000000LL; //1sec
-
-static void tlmu_hosttimer_start(int64_t delta_ns)
+static pthread_cond_t timer_cond;
+static pthread_t timer_thread;
+static struct tlmu_timer **timer_heap = NULL;
+static unsigned int timer_heap_len = 0;
+static unsigned int timer_heap_size = 0;
+static unsigned int nr_timers = 0;
+
+static int64_t tlmu_timer_now(void)
 {
-	struct itimerspec timeout;
+	struct timespec tp;
 
-	timeout.it_interval.tv_sec = 0;
-	timeout.it_interval.tv_nsec = 0;
-	timeout.it_value.tv_sec =  delta_ns / 1000000000;
-	timeout.it_value.tv_nsec = delta_ns % 1000000000;
-	if (timer_settime(tlmu_hosttimer, 0, &timeout, NULL)) {
-		perror("settime");
+	if (clock_gettime(CLOCK_MONOTONIC, &tp)) {
+		perror("clock_gettime");
 		exit(1);
 	}
+	return tp.tv_sec * 1000000000LL + tp.tv_nsec;
 }
 
-static int64_t tlmu_timers_run(int64_t current_ns)
+static inline void timer_heap_set(unsigned int i, struct tlmu_timer *t)
 {
-	struct tlmu_timer *t = timers;
-	int64_t next_deadline = INT64_MAX;
+	timer_heap[i] = t;
+	t->heap_idx = i;
+}
+
+static void timer_heap_up(unsigned int i)
+{
+	struct tlmu_timer *t = timer_heap[i];
+	unsigned int parent;
 
-	while (t) {
-		if (t->pending) {
-			if (current_ns > t->expire_time) {
-				t->pending = 0;
-				t->cb(t->o);
-			} else {
-				if (t->expire_time < next_deadline) {
-					next_deadline = t->expire_time;
-				}
-			}
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (timer_heap[parent]->expire_time <= t->expire_time) {
+			break;
 		}
-		t = t->next;
-	}
-	if(next_deadline == INT64_MAX) { //no timers found
-		next_deadline = current_ns + default_next_timer_check_ns;
+		timer_heap_set(i, timer_heap[parent]);
+		i = parent;
 	}
-
-	return next_deadline;
+	timer_heap_set(i, t);
 }
 
-static void tlmu_hosttimer_handler(int host_signum)
+static void timer_heap_down(unsigned int i)
 {
-	struct timespec tp;
-	int64_t current_ns;
-	int64_t next_ns;
-
-//	printf("%s:\n", __func__);
-	clock_gettime(CLOCK_REALTIME, &tp);
-
-	current_ns = tp.tv_sec * 1000000000LL + tp.tv_nsec;
-	next_ns = tlmu_timers_run(current_ns);
-	tlmu_hosttimer_start(next_ns - current_ns);
+	struct tlmu_timer *t = timer_heap[i];
+	unsigned int child;
+
+	while ((child = 2 * i + 1) < timer_heap_len) {
+		if (child + 1 < timer_heap_len
+		    && timer_heap[child + 1]->expire_time
+			< timer_heap[child]->expire_time) {
+			child++;
+		}
+		if (t->expire_time <= timer_heap[child]->expire_time) {
+			break;
+		}
+		timer_heap_set(i, timer_heap[child]);
+		i = child;
+	}
+	timer_heap_set(i, t);
 }
 
-static void tlmu_hosttimer_block(void)
+static void timer_heap_insert(struct tlmu_timer *t)
 {
-	sigset_t mask;
+	assert(timer_heap_len < timer_heap_size);
+	timer_heap_set(timer_heap_len++, t);
+	timer_heap_up(t->heap_idx);
+}
 
-	sigemptyset(&mask);
-	sigaddset(&mask, SIGALRM);
-	if (sigprocmask(SIG_SETMASK, &mask, NULL) == -1) {
-		perror("sigprocmask");
-		exit(1);
+static void timer_heap_remove(struct tlmu_timer *t)
+{
+	unsigned int i = t->heap_idx;
+
+	assert(timer_heap[i] == t);
+	timer_heap_len--;
+	if (i != timer_heap_len) {
+		timer_heap_set(i, timer_heap[timer_heap_len]);
+		timer_heap_up(i);
+		timer_heap_down(timer_heap[i]->heap_idx);
 	}
 }
 
-static void tlmu_hosttimer_unblock(void)
+static void *tlmu_timer_thread(void *arg)
 {
-	sigset_t mask;
+	struct tlmu_timer *t;
+	struct timespec ts;
+	int64_t now;
+	void (*cb)(void *o);
+	void *o;
 
-	sigemptyset(&mask);
-	sigaddset(&mask, SIGALRM);
-	if (sigprocmask(SIG_UNBLOCK, &mask, NULL) == -1) {
-		perror("sigprocmask");
-		exit(1);
+	pthread_mutex_lock(&timer_mutex);
+	while (1) {
+		if (!timer_heap_len) {
+			pthread_cond_wait(&timer_cond, &timer_mutex);
+			continue;
+		}
+
+		t = timer_heap[0];
+		now = tlmu_timer_now();
+		if (t->expire_time > now) {
+			ts.tv_sec = t->expire_time / 1000000000LL;
+			ts.tv_nsec = t->expire_time % 1000000000LL;
+			pthread_cond_timedwait(&timer_cond, &timer_mutex, &ts);
+			continue;
+		}
+
+		timer_heap_remove(t);
+		t->pending = 0;
+		cb = t->cb;
+		o = t->o;
+
+		/* The callback may rearm the timer, run it unlocked.  */
+		pthread_mutex_unlock(&timer_mutex);
+		cb(o);
+		pthread_mutex_lock(&timer_mutex);
 	}
+	return NULL;
 }
 
 static void tlmu_timer_start(void *o,
 			void *cb_o, void (*cb)(void *), int64_t delta_ns)
 {
 	struct tlmu *q = o;
-	struct timespec tp;
-	int64_t current_ns, next_ns;
+	struct tlmu_timer *t = &q->timer;
 
 //	printf("%s: delta=%ld\n", __func__, delta_ns);
 	if (delta_ns < 0) {
@@ -141,47 +186,41 @@ static void tlmu_timer_start(void *o,
 		return;
 	}
 
-	tlmu_hosttimer_block();
 	pthread_mutex_lock(&timer_mutex);
-	if (clock_gettime(CLOCK_REALTIME, &tp)) {
-		perror("clock_gettime");
-		exit(1);
+	if (t->pending) {
+		timer_heap_remove(t);
+	}
+	t->expire_time = tlmu_timer_now() + delta_ns;
+	t->o = cb_o;
+	t->cb = cb;
+	t->pending = 1;
+	timer_heap_insert(t);
+
+	/* Only wake the thread if its next deadline changed.  */
+	if (t->heap_idx == 0) {
+		pthread_cond_signal(&timer_cond);
 	}
-
-	current_ns = tp.tv_sec * 1000000000LL + tp.tv_nsec;
-
-	q->timer.expire_time = current_ns + delta_ns;
-	q->timer.o = cb_o;
-	q->timer.cb = cb;
-	q->timer.pending = 1;
-
-	/* FIXME: Walk the timers and get the nearset deadline.  */
-	next_ns = tlmu_timers_run(current_ns);
-	tlmu_hosttimer_start(next_ns - current_ns);
-
 	pthread_mutex_unlock(&timer_mutex);
-	tlmu_hosttimer_unblock();
 }
 
 static void tlmu_timers_init(void)
 {
-	struct sigevent ev;
-	struct sigaction act;
-
-	sigfillset(&act.sa_mask);
-	act.sa_flags = 0;
-	act.sa_handler = tlmu_hosttimer_handler;
-
-	sigaction(SIGALRM, &act, NULL);
-
-	memset(&ev, 0, sizeof(ev));
-	ev.sigev_value.sival_int = 0;
-	ev.sigev_notify = SIGEV_SIGNAL;
-	ev.sigev_signo = SIGALRM;
-	if (timer_create(CLOCK_REALTIME, &ev, &tlmu_hosttimer)) {
-		perror("timer_create\n");
+	pthread_condattr_t attr;
+	sigset_t mask, oldmask;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&timer_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/* Keep signals on the emulator threads.  */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &oldmask);
+	if (pthread_create(&timer_thread, NULL, tlmu_timer_thread, NULL)) {
+		perror("pthread_create");
 		exit(1);
 	}
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
 }
 
 
@@ -201,28 +240,67 @@ void tlmu_init(struct tlmu *t, const char *name)
 	tlmu_append_arg(t, "-clock");
 	tlmu_append_arg(t, "tlm");
 
-	/* Link in our timer as non-pending.  */
+	/* Make room for our timer in the heap.  */
 	pthread_mutex_lock(&timer_mutex);
 	if (!init) {
 		tlmu_timers_init();
-		tlmu_hosttimer_unblock();
 		init = 1;
 	}
 
-	t->timer.next = timers;
-	timers = &t->timer;
+	if (timer_heap_size == nr_timers) {
+		struct tlmu_timer **heap;
+
+		heap = realloc(timer_heap,
+			       (timer_heap_size + 16) * sizeof *timer_heap);
+		if (!heap) {
+			perror("realloc");
+			exit(1);
+		}
+		timer_heap = heap;
+		timer_heap_size += 16;
+	}
+	nr_timers++;
 	pthread_mutex_unlock(&timer_mutex);
 }
 
-static void copylib(const char *path, const char *newpath)
+/* Copy src into the new file dst, sharing extents if the fs can.  */
+static int copyfile(int s, int d)
+{
+	struct stat stb;
+	off_t left;
+	ssize_t r;
+
+#ifdef FICLONE
+	if (ioctl(d, FICLONE, s) == 0) {
+		return 0;
+	}
+#endif
+	if (fstat(s, &stb)) {
+		return -1;
+	}
+
+	left = stb.st_size;
+	while (left > 0) {
+		r = sendfile(d, s, NULL, left);
+		if (r < 0 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		}
+		if (r <= 0) {
+			return -1;
+		}
+		left -= r;
+	}
+	return 0;
+}
+
+static int copylib(const char *path, const char *newpath)
 {
 	int s = -1, d = -1;
-	ssize_t r, wr;
 	const char *ld_path = NULL;
 	Dl_info info;
 	void *handle;
 	void *addr;
-	int ret;
+	int ret = -1;
 	struct stat stb;
 
 	if (stat(path, &stb) == 0) {
@@ -237,10 +315,10 @@ static void copylib(const char *path, const char *newpath)
 		}
 
 		addr = dlsym(handle, "vl_main");
-		ret = dladdr(addr, &info);
-		if (!ret) {
+		if (!dladdr(addr, &info)) {
 			perror("dladdr");
 			fprintf(stderr, "vl_main doesn't exist in TLMu??\n");
+			dlclose(handle);
 			goto err;
 		}
 
@@ -255,45 +333,65 @@ static void copylib(const char *path, const char *newpath)
 		goto err;
 	}
 
-	d = open(newpath, O_WRONLY | O_CREAT, S_IRWXU | S_IRWXG);
+	unlink(newpath);
+	d = open(newpath, O_WRONLY | O_CREAT | O_EXCL, S_IRWXU | S_IRWXG);
 	if (d < 0) {
-		if (errno != EEXIST) {
-			perror(newpath);
-		}
+		perror(newpath);
 		goto err;
 	}
-	do {
-		ssize_t written;
-
-		char buf[4 * 1024];
-		r = read(s, buf, sizeof buf);
-		if (r < 0 && (errno == EINTR || errno == EAGAIN))
-			continue;
-		/* TODO: handle partial writes.  */
-		if (r > 0) {
-			written = 0;
-			do {
-				wr = write(d, buf, r);
-				if (wr <= 0) {
-					goto err;
-				}
-				written += wr;
-			} while (written < r);
-		}
-	} while (r);
+	ret = copyfile(s, d);
+	if (ret) {
+		perror(newpath);
+	}
 err:
 	free((void *) ld_path);
-	close(s);
-	close(d);
+	if (s >= 0)
+		close(s);
+	if (d >= 0)
+		close(d);
+	return ret;
 }
 
-int tlmu_load(struct tlmu *q, const char *soname)
+/*
+ * Open the emulator library with a private set of globals.
+ *
+ * The first instance of a library gets it as is. The next ones load a
+ * private copy of the library. dlmopen() namespaces would let them share
+ * the text pages but the namespace's libc doesn't set up its thread local
+ * state (e.g ctype tables) for threads created outside of it, so the
+ * emulators crash when run from the application's threads.
+ */
+static void *tlmu_dlopen(struct tlmu *q, const char *soname,
+			 const char *sobasename)
 {
 	char *libname;
+	void *handle;
+
+	handle = dlopen(soname, RTLD_LOCAL | RTLD_DEEPBIND | RTLD_NOW
+			| RTLD_NOLOAD);
+	if (!handle) {
+		return dlopen(soname, RTLD_LOCAL | RTLD_DEEPBIND | RTLD_NOW);
+	}
+	dlclose(handle);
+
+	if (asprintf(&libname, ".tlmu/%s-%s", sobasename, q->name) < 0) {
+		return NULL;
+	}
+
+	if (copylib(soname, libname) == 0) {
+		handle = dlopen(libname, RTLD_LOCAL | RTLD_DEEPBIND | RTLD_NOW);
+	}
+	/* Once mapped, the copy is no longer needed.  */
+	unlink(libname);
+	free(libname);
+	return handle;
+}
+
+int tlmu_load(struct tlmu *q, const char *soname)
+{
 	char *logname;
 	char *sobasename;
 	char *socopy;
-	int err = 0;
 	int n;
 
 	mkdir(".tlmu", S_IRWXU | S_IRWXG);
@@ -301,18 +399,7 @@ int tlmu_load(struct tlmu *q, const char *soname)
 	socopy = strdup(soname);
 	sobasename = basename(socopy);
 
-	n = asprintf(&libname, ".tlmu/%s-%s", sobasename, q->name);
-	if (n < 0)
-		return 1;
-
-	copylib(soname, libname);
-
-	q->dl_handle = dlopen(libname, RTLD_LOCAL | RTLD_DEEPBIND | RTLD_NOW);
-//	err = unlink(libname);
-	if (err) {
-		perror(libname);
-	}
-	free(libname);
+	q->dl_handle = tlmu_dlopen(q, soname, sobasename);
 	if (!q->dl_handle) {
 		free(socopy);
 		return 1;
@@ -323,34 +410,83 @@ int tlmu_load(struct tlmu *q, const char *soname)
 	q->tlm_image_load_base = dlsym(q->dl_handle, "tlm_image_load_base");
 	q->tlm_image_load_size = dlsym(q->dl_handle, "tlm_image_load_size");
 	q->tlm_map_ram = dlsym(q->dl_handle, "tlm_map_ram");
+	q->tlm_map_ram_ptr = dlsym(q->dl_handle, "tlm_map_ram_ptr");
+	q->tlm_snapshot_save = dlsym(q->dl_handle, "tlm_snapshot_save");
+	q->tlm_snapshot_status = dlsym(q->dl_handle, "tlm_snapshot_status");
+	q->tlm_snapshot_load_file = dlsym(q->dl_handle,
+					"tlm_snapshot_load_file");
 	q->tlm_opaque = dlsym(q->dl_handle, "tlm_opaque");
 	q->tlm_notify_event = dlsym(q->dl_handle, "tlm_notify_event");
+	q->tlm_notify_event_cpu = dlsym(q->dl_handle, "tlm_notify_event_cpu");
+	q->tlm_current_cpu = dlsym(q->dl_handle, "tlm_current_cpu");
+	q->tlm_set_irq = dlsym(q->dl_handle, "tlm_set_irq");
+	q->tlm_irq_sync = dlsym(q->dl_handle, "tlm_irq_sync");
 	q->tlm_timer_opaque = dlsym(q->dl_handle, "tlm_timer_opaque");
 	q->tlm_timer_start = dlsym(q->dl_handle, "tlm_timer_start");
 	q->tlm_sync = dlsym(q->dl_handle, "tlm_sync");
 	q->tlm_sync_period_ns = dlsym(q->dl_handle, "tlm_sync_period_ns");
+	q->tlm_sync_decoupled = dlsym(q->dl_handle, "tlm_sync_decoupled");
+	q->tlm_quantum_ns = dlsym(q->dl_handle, "tlm_quantum_ns");
+	q->tlm_quantum_opaque = dlsym(q->dl_handle, "tlm_quantum_opaque");
+	q->tlm_quantum_barrier = dlsym(q->dl_handle, "tlm_quantum_barrier");
 	q->tlm_boot_state = dlsym(q->dl_handle, "tlm_boot_state");
+	q->tlm_dmi_tlb = dlsym(q->dl_handle, "tlm_dmi_tlb");
+	q->tlm_stats = dlsym(q->dl_handle, "tlm_stats");
+	q->tlm_prof = dlsym(q->dl_handle, "tlm_prof");
+	q->tlm_prof_dump = dlsym(q->dl_handle, "tlm_prof_dump");
+	q->tlm_cov = dlsym(q->dl_handle, "tlm_cov");
+	q->tlm_trace = dlsym(q->dl_handle, "tlm_trace");
+	q->tlm_trace_set_mem = dlsym(q->dl_handle, "tlm_trace_set_mem");
+	q->tlm_line_size = dlsym(q->dl_handle, "tlm_line_size");
+	q->tlm_tb_size = dlsym(q->dl_handle, "tlm_tb_size");
+	q->tlm_tb_size_max = dlsym(q->dl_handle, "tlm_tb_size_max");
+	q->tlm_jmp_cache_bits = dlsym(q->dl_handle, "tlm_jmp_cache_bits");
 	q->tlm_bus_access_cb = dlsym(q->dl_handle, "tlm_bus_access_cb");
 	q->tlm_bus_access_dbg_cb = dlsym(q->dl_handle, "tlm_bus_access_dbg_cb");
 	q->tlm_bus_access = dlsym(q->dl_handle, "tlm_bus_access");
+	q->tlm_bus_access_burst = dlsym(q->dl_handle, "tlm_bus_access_burst");
 	q->tlm_bus_access_dbg = dlsym(q->dl_handle, "tlm_bus_access_dbg");
 	q->tlm_get_dmi_ptr_cb = dlsym(q->dl_handle, "tlm_get_dmi_ptr_cb");
 	q->tlm_get_dmi_ptr = dlsym(q->dl_handle, "tlm_get_dmi_ptr");
 	tlmu_set_timer_start_cb(q, q, tlmu_timer_start);
 	if (!q->main
 		|| !q->tlm_map_ram
+		|| !q->tlm_map_ram_ptr
+		|| !q->tlm_snapshot_save
+		|| !q->tlm_snapshot_status
+		|| !q->tlm_snapshot_load_file
 		|| !q->tlm_set_log_filename
 		|| !q->tlm_image_load_base
 		|| !q->tlm_image_load_size
 		|| !q->tlm_opaque
 		|| !q->tlm_notify_event
+		|| !q->tlm_notify_event_cpu
+		|| !q->tlm_current_cpu
+		|| !q->tlm_set_irq
+		|| !q->tlm_irq_sync
 		|| !q->tlm_timer_start
 		|| !q->tlm_sync
 		|| !q->tlm_sync_period_ns
+		|| !q->tlm_sync_decoupled
+		|| !q->tlm_quantum_ns
+		|| !q->tlm_quantum_opaque
+		|| !q->tlm_quantum_barrier
 		|| !q->tlm_boot_state
+		|| !q->tlm_dmi_tlb
+		|| !q->tlm_stats
+		|| !q->tlm_prof
+		|| !q->tlm_prof_dump
+		|| !q->tlm_cov
+		|| !q->tlm_trace
+		|| !q->tlm_trace_set_mem
+		|| !q->tlm_line_size
+		|| !q->tlm_tb_size
+		|| !q->tlm_tb_size_max
+		|| !q->tlm_jmp_cache_bits
 		|| !q->tlm_bus_access_cb
 		|| !q->tlm_bus_access_dbg_cb
 		|| !q->tlm_bus_access
+		|| !q->tlm_bus_access_burst
 		|| !q->tlm_bus_access_dbg
 		|| !q->tlm_get_dmi_ptr_cb
 		|| !q->tlm_get_dmi_ptr) {
@@ -360,6 +496,10 @@ int tlmu_load(struct tlmu *q, const char *soname)
 	}
 
 	n = asprintf(&logname, ".tlmu/%s-%s.log", sobasename, q->name);
+	if (n < 0) {
+		free(socopy);
+		return 1;
+	}
 	tlmu_set_log_filename(q, logname);
 	free(logname);
 
@@ -372,6 +512,27 @@ void tlmu_notify_event(struct tlmu *q, enum tlmu_event ev, void *d)
 	q->tlm_notify_event(ev, d);
 }
 
+int tlmu_notify_event_cpu(struct tlmu *q, int cpu,
+			enum tlmu_event ev, void *d)
+{
+	return q->tlm_notify_event_cpu(cpu, ev, d);
+}
+
+int tlmu_current_cpu(struct tlmu *q)
+{
+	return q->tlm_current_cpu();
+}
+
+void tlmu_set_irq(struct tlmu *q, int line, int level)
+{
+	q->tlm_set_irq(line, level);
+}
+
+void tlmu_set_irq_sync(struct tlmu *q, int v)
+{
+	*q->tlm_irq_sync = v;
+}
+
 void tlmu_set_opaque(struct tlmu *q, void *o)
 {
 	*q->tlm_opaque = o;
@@ -400,11 +561,37 @@ void tlmu_set_sync_period_ns(struct tlmu *q, uint64_t period_ns)
 	*q->tlm_sync_period_ns = period_ns;
 }
 
+void tlmu_set_sync_decoupled(struct tlmu *q, int v)
+{
+	*q->tlm_sync_decoupled = v;
+}
+
 void tlmu_set_boot_state(struct tlmu *q, int v)
 {
 	*q->tlm_boot_state = v;
 }
 
+void tlmu_set_dmi_tlb(struct tlmu *q, int v)
+{
+	*q->tlm_dmi_tlb = v;
+}
+
+void tlmu_set_line_fill_size(struct tlmu *q, uint32_t size)
+{
+	*q->tlm_line_size = size;
+}
+
+void tlmu_set_tb_size(struct tlmu *q, uint64_t size, uint64_t max_size)
+{
+	*q->tlm_tb_size = size;
+	*q->tlm_tb_size_max = max_size;
+}
+
+void tlmu_set_jmp_cache_bits(struct tlmu *q, unsigned int bits)
+{
+	*q->tlm_jmp_cache_bits = bits;
+}
+
 void tlmu_set_sync_cb(struct tlmu *q, void (*cb)(void *, int64_t))
 {
 	*q->tlm_sync = cb;
@@ -422,6 +609,12 @@ int tlmu_bus_access(struct tlmu *q, int rw, uint64_t addr, void *data, int len)
 	return q->tlm_bus_access(rw, addr, data, len);
 }
 
+int tlmu_bus_access_burst(struct tlmu *q, int rw, uint64_t addr,
+			void *data, int len)
+{
+	return q->tlm_bus_access_burst(rw, addr, data, len);
+}
+
 void tlmu_bus_access_dbg(struct tlmu *q,
 			int rw, uint64_t addr, void *data, int len)
 {
@@ -439,11 +632,368 @@ void tlmu_map_ram(struct tlmu *q, const char *name,
 	q->tlm_map_ram(name, addr, size, rw);
 }
 
+void tlmu_map_ram_ptr(struct tlmu *q, const char *name,
+		uint64_t addr, uint64_t size, int rw, void *host)
+{
+	q->tlm_map_ram_ptr(name, addr, size, rw, host);
+}
+
+int tlmu_snapshot_save(struct tlmu *q, const char *filename)
+{
+	return q->tlm_snapshot_save(filename);
+}
+
+int tlmu_snapshot_status(struct tlmu *q)
+{
+	return *q->tlm_snapshot_status;
+}
+
+void tlmu_snapshot_load(struct tlmu *q, const char *filename)
+{
+	/* Replaces a file not loaded yet, the emulator frees it once
+	   loaded.  */
+	free((void *) *q->tlm_snapshot_load_file);
+	*q->tlm_snapshot_load_file = strdup(filename);
+}
+
 void tlmu_set_log_filename(struct tlmu *q, const char *f)
 {
 	q->tlm_set_log_filename(f);
 }
 
+void tlmu_get_stats(struct tlmu *q, struct tlmu_stats *stats)
+{
+	*stats = *q->tlm_stats;
+}
+
+void tlmu_set_tb_prof(struct tlmu *q, int v)
+{
+	*q->tlm_prof = v;
+}
+
+int tlmu_tb_prof_dump(struct tlmu *q, const char *filename)
+{
+	return q->tlm_prof_dump(filename);
+}
+
+int tlmu_set_coverage(struct tlmu *q, void *bitmap,
+		uint64_t base, uint64_t size, unsigned int granule)
+{
+	struct tlmu_cov *cov = q->tlm_cov;
+	unsigned int shift = 0;
+	void *old;
+	int owned = 0;
+
+	/* tlm_cov_mark reads the fields one by one.  */
+	if (q->running)
+		return 1;
+	if (!size || size > (1ULL << 32)
+	    || !granule || (granule & (granule - 1)))
+		return 1;
+
+	while ((1U << shift) < granule)
+		shift++;
+
+	if (!bitmap) {
+		bitmap = calloc(((size - 1) >> shift) / 8 + 1, 1);
+		if (!bitmap)
+			return 1;
+		owned = 1;
+	}
+
+	old = cov->bitmap;
+	cov->base = base;
+	cov->size = size;
+	cov->granule_shift = shift;
+	cov->bitmap = bitmap;
+
+	/* Never free a bitmap the caller handed us.  */
+	if (q->cov_owned)
+		free(old);
+	q->cov_owned = owned;
+	return 0;
+}
+
+/* drcov basic block entry.  */
+struct tlmu_drcov_bb {
+	uint32_t start;
+	uint16_t size;
+	uint16_t mod_id;
+} __attribute__((packed));
+
+#define TLMU_DRCOV_BB_MAX 0x8000
+
+/*
+ * Emit the covered ranges as drcov basic blocks, or just count them if
+ * fp is NULL. Returns the number of blocks.
+ */
+static unsigned int cov_write_bbs(struct tlmu_cov *cov, FILE *fp)
+{
+	uint64_t nr_bits = ((cov->size - 1) >> cov->granule_shift) + 1;
+	uint64_t i = 0, start, end;
+	struct tlmu_drcov_bb bb;
+	unsigned int n = 0;
+
+	while (i < nr_bits) {
+		if (!cov->bitmap[i / 8]) {
+			i = (i / 8 + 1) * 8;
+			continue;
+		}
+		if (!(cov->bitmap[i / 8] & (1 << (i % 8)))) {
+			i++;
+			continue;
+		}
+
+		start = i;
+		while (i < nr_bits && (cov->bitmap[i / 8] & (1 << (i % 8))))
+			i++;
+
+		start <<= cov->granule_shift;
+		end = i << cov->granule_shift;
+		if (end > cov->size)
+			end = cov->size;
+		for (; start < end; start += bb.size) {
+			bb.start = start;
+			bb.size = end - start > TLMU_DRCOV_BB_MAX
+				? TLMU_DRCOV_BB_MAX : end - start;
+			bb.mod_id = 0;
+			if (fp)
+				fwrite(&bb, sizeof bb, 1, fp);
+			n++;
+		}
+	}
+	return n;
+}
+
+int tlmu_cov_dump(struct tlmu *q, const char *filename)
+{
+	struct tlmu_cov *cov = q->tlm_cov;
+	FILE *fp;
+	int r = 0;
+
+	if (!cov->bitmap)
+		return 1;
+
+	fp = fopen(filename, "wb");
+	if (!fp) {
+		perror(filename);
+		return 1;
+	}
+
+	fprintf(fp, "DRCOV VERSION: 2\n");
+	fprintf(fp, "DRCOV FLAVOR: tlmu\n");
+	fprintf(fp, "Module Table: version 2, count 1\n");
+	fprintf(fp, "Columns: id, base, end, entry, checksum, timestamp, "
+		"path\n");
+	fprintf(fp, " 0, 0x%016" PRIx64 ", 0x%016" PRIx64 ", "
+		"0x0000000000000000, 0x00000000, 0x00000000, %s\n",
+		cov->base, cov->base + cov->size, q->name);
+	fprintf(fp, "BB Table: %u bbs\n", cov_write_bbs(cov, NULL));
+	cov_write_bbs(cov, fp);
+
+	if (ferror(fp))
+		r = 1;
+	if (fclose(fp))
+		r = 1;
+	return r;
+}
+
+int tlmu_cov_merge(struct tlmu *q, const char *filename)
+{
+	struct tlmu_cov *cov = q->tlm_cov;
+	struct tlmu_drcov_bb bb;
+	uint64_t mod_base = cov->base;
+	uint64_t addr, i;
+	unsigned int n = 0;
+	char line[512];
+	FILE *fp;
+	int r = 1;
+
+	if (!cov->bitmap)
+		return 1;
+
+	fp = fopen(filename, "rb");
+	if (!fp) {
+		perror(filename);
+		return 1;
+	}
+
+	while (fgets(line, sizeof line, fp)) {
+		sscanf(line, " 0, 0x%" SCNx64 ",", &mod_base);
+		if (sscanf(line, "BB Table: %u bbs", &n) == 1) {
+			r = 0;
+			break;
+		}
+	}
+
+	while (!r && n--) {
+		if (fread(&bb, sizeof bb, 1, fp) != 1) {
+			r = 1;
+			break;
+		}
+
+		addr = mod_base + bb.start;
+		if (bb.mod_id || !bb.size || addr < cov->base
+		    || addr + bb.size > cov->base + cov->size)
+			continue;
+
+		for (i = (addr - cov->base) >> cov->granule_shift;
+		     i <= (addr + bb.size - 1 - cov->base) >> cov->granule_shift;
+		     i++) {
+			__sync_fetch_and_or(&cov->bitmap[i / 8], 1 << (i % 8));
+		}
+	}
+
+	fclose(fp);
+	return r;
+}
+
+/*
+ * The trace ring gets drained into the file by a background thread, so
+ * the emulator never formats or writes anything itself.
+ */
+struct tlmu_tracer {
+	struct tlmu_trace *ring;
+	/* ring->recs gets cleared on stop while we still drain it.  */
+	struct tlmu_trace_rec *recs;
+	FILE *fp;
+	pthread_t thread;
+	volatile int stop;
+	int err;
+};
+
+#define TLMU_TRACE_DEFAULT_RECS (1 << 18)
+
+static void *tlmu_trace_thread(void *p)
+{
+	struct tlmu_tracer *tr = p;
+	struct tlmu_trace *ring = tr->ring;
+	uint64_t head, tail = ring->tail;
+	uint64_t n, idx;
+	int stop;
+
+	for (;;) {
+		/* Sample stop before head, so a stop sees the last records.  */
+		stop = tr->stop;
+		__sync_synchronize();
+		head = ring->head;
+		__sync_synchronize();
+
+		if (head == tail) {
+			if (stop)
+				break;
+			usleep(1000);
+			continue;
+		}
+
+		idx = tail & ring->mask;
+		n = head - tail;
+		if (idx + n > ring->mask + 1)
+			n = ring->mask + 1 - idx;
+
+		if (fwrite(&tr->recs[idx], sizeof tr->recs[0], n, tr->fp)
+		    != n)
+			tr->err = 1;
+
+		tail += n;
+		__sync_synchronize();
+		ring->tail = tail;
+	}
+	return NULL;
+}
+
+int tlmu_trace_start(struct tlmu *q, const char *filename,
+		unsigned int nr_recs)
+{
+	struct tlmu_trace *ring = q->tlm_trace;
+	struct tlmu_tracer *tr;
+	uint32_t hdr[2];
+
+	if (q->tracer)
+		return 1;
+	if (!nr_recs)
+		nr_recs = TLMU_TRACE_DEFAULT_RECS;
+	if (nr_recs & (nr_recs - 1))
+		return 1;
+
+	tr = calloc(1, sizeof *tr);
+	if (!tr)
+		return 1;
+	tr->ring = ring;
+	tr->fp = fopen(filename, "wb");
+	if (!tr->fp) {
+		perror(filename);
+		free(tr);
+		return 1;
+	}
+
+	hdr[0] = TLMU_TRACE_VERSION;
+	hdr[1] = sizeof ring->recs[0];
+	if (fwrite(TLMU_TRACE_MAGIC, 8, 1, tr->fp) != 1
+	    || fwrite(hdr, sizeof hdr, 1, tr->fp) != 1)
+		goto err;
+
+	tr->recs = malloc(nr_recs * sizeof tr->recs[0]);
+	if (!tr->recs)
+		goto err;
+	ring->mask = nr_recs - 1;
+	ring->head = ring->tail = 0;
+	ring->icount = 0;
+
+	if (pthread_create(&tr->thread, NULL, tlmu_trace_thread, tr)) {
+		free(tr->recs);
+		goto err;
+	}
+	/* Publish the ring last, the emulator may already be running.  */
+	__sync_synchronize();
+	ring->recs = tr->recs;
+	q->tracer = tr;
+	return 0;
+
+err:
+	fclose(tr->fp);
+	free(tr);
+	return 1;
+}
+
+void tlmu_trace_set_exec(struct tlmu *q, int on)
+{
+	q->tlm_trace->exec = on;
+}
+
+void tlmu_trace_set_mem(struct tlmu *q, unsigned int sample)
+{
+	q->tlm_trace_set_mem(sample);
+}
+
+int tlmu_trace_stop(struct tlmu *q)
+{
+	struct tlmu_tracer *tr = q->tracer;
+	struct tlmu_trace *ring = q->tlm_trace;
+	int r;
+
+	if (!tr)
+		return 1;
+
+	/* Unpublish the ring and wait for a record being written to land,
+	   see tlm_trace_put.  */
+	ring->recs = NULL;
+	__sync_synchronize();
+	while (ring->busy)
+		sched_yield();
+
+	tr->stop = 1;
+	pthread_join(tr->thread, NULL);
+	r = tr->err;
+	if (fclose(tr->fp))
+		r = 1;
+
+	free(tr->recs);
+	free(tr);
+	q->tracer = NULL;
+	return r;
+}
+
 void tlmu_set_image_load_params(struct tlmu *q, uint64_t base, uint64_t size)
 {
 	*q->tlm_image_load_base = base;
@@ -473,12 +1023,134 @@ void tlmu_run(struct tlmu *t)
 	while (t->argv[argc])
 		argc++;
 
+	t->running = 1;
 	done = setjmp(t->top);
 	if (!done)
 		t->main(0, 1, 1, argc, t->argv, NULL);
+	t->running = 0;
 }
 
 void tlmu_exit(struct tlmu *t)
 {
 	longjmp(t->top, 1);
 }
+
+/*
+ * Instances run by tlmu_run_parallel meet at a barrier on every quantum
+ * edge. The last one to arrive calls the exchange callback and releases
+ * the others. Exited instances leave the group so they don't hold back
+ * the rest.
+ */
+struct tlmu_group {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned int nr_active;
+	unsigned int nr_arrived;
+	unsigned int generation;
+	int64_t time_ns;
+	int stop;
+
+	int (*exchange)(void *o, int64_t time_ns);
+	void *o;
+};
+
+/* Called with the group mutex held.  */
+static void tlmu_group_release(struct tlmu_group *g)
+{
+	if (g->exchange && !g->stop && g->exchange(g->o, g->time_ns))
+		g->stop = 1;
+
+	g->nr_arrived = 0;
+	g->generation++;
+	pthread_cond_broadcast(&g->cond);
+}
+
+static void tlmu_group_leave(struct tlmu_group *g, unsigned int n)
+{
+	pthread_mutex_lock(&g->mutex);
+	g->nr_active -= n;
+	if (g->nr_active && g->nr_arrived == g->nr_active)
+		tlmu_group_release(g);
+	pthread_mutex_unlock(&g->mutex);
+}
+
+static void tlmu_quantum_barrier(void *o, int64_t time_ns)
+{
+	struct tlmu *q = o;
+	struct tlmu_group *g = q->group;
+	unsigned int gen;
+	int stop;
+
+	pthread_mutex_lock(&g->mutex);
+	gen = g->generation;
+	g->time_ns = time_ns;
+	if (++g->nr_arrived == g->nr_active) {
+		tlmu_group_release(g);
+	} else {
+		while (gen == g->generation)
+			pthread_cond_wait(&g->cond, &g->mutex);
+	}
+	stop = g->stop;
+	pthread_mutex_unlock(&g->mutex);
+
+	if (stop)
+		tlmu_exit(q);
+}
+
+static void *tlmu_group_thread(void *p)
+{
+	struct tlmu *q = p;
+
+	tlmu_run(q);
+	tlmu_group_leave(q->group, 1);
+	return NULL;
+}
+
+int tlmu_run_parallel(struct tlmu **t, int n, uint64_t quantum_ns,
+		int (*exchange)(void *o, int64_t time_ns), void *o)
+{
+	struct tlmu_group g;
+	pthread_t *tids;
+	int i, started;
+
+	memset(&g, 0, sizeof g);
+	pthread_mutex_init(&g.mutex, NULL);
+	pthread_cond_init(&g.cond, NULL);
+	g.nr_active = n;
+	g.exchange = exchange;
+	g.o = o;
+
+	tids = calloc(n, sizeof *tids);
+	if (!tids)
+		return 1;
+
+	for (i = 0; i < n; i++) {
+		t[i]->group = &g;
+		*t[i]->tlm_quantum_ns = quantum_ns;
+		*t[i]->tlm_quantum_opaque = t[i];
+		*t[i]->tlm_quantum_barrier = tlmu_quantum_barrier;
+	}
+
+	for (started = 0; started < n; started++) {
+		if (pthread_create(&tids[started], NULL,
+				tlmu_group_thread, t[started])) {
+			perror("pthread_create");
+			/* Stop the ones already running at the next edge.  */
+			pthread_mutex_lock(&g.mutex);
+			g.stop = 1;
+			pthread_mutex_unlock(&g.mutex);
+			tlmu_group_leave(&g, n - started);
+			break;
+		}
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+	for (i = 0; i < n; i++)
+		t[i]->group = NULL;
+
+	free(tids);
+	pthread_cond_destroy(&g.cond);
+	pthread_mutex_destroy(&g.mutex);
+	return started != n;
+}
@@ -31,7 +31,8 @@ struct tlmu_timer {
 	void *o;
 	void (*cb)(void *o);
 
-	struct tlmu_timer *next;
+	/* Position in the timer heap while pending.  */
+	unsigned int heap_idx;
 };
 
 struct tlmu
@@ -42,6 +43,18 @@ struct tlmu
 	/* We only need one timer per instance.  */
 	struct tlmu_timer timer;
 
+	/* Set while running under tlmu_run_parallel.  */
+	struct tlmu_group *group;
+
+	/* Set while an execution trace is being written.  */
+	struct tlmu_tracer *tracer;
+
+	/* Set if the coverage bitmap was allocated by tlmu_set_coverage.  */
+	int cov_owned;
+
+	/* Set while inside tlmu_run.  */
+	int running;
+
 	void *dl_handle;
 
 	/* TODO: Make this dynamic.  */
@@ -52,6 +65,11 @@ struct tlmu
 
 	void (*tlm_map_ram)(const char *name,
 			    uint64_t addr, uint64_t size, int rw);
+	void (*tlm_map_ram_ptr)(const char *name,
+			    uint64_t addr, uint64_t size, int rw, void *host);
+	int (*tlm_snapshot_save)(const char *filename);
+	int *tlm_snapshot_status;
+	const char **tlm_snapshot_load_file;
 	void **tlm_opaque;
 	void **tlm_timer_opaque;
 	uint64_t *tlm_image_load_base;
@@ -59,16 +77,36 @@ struct tlmu
 
 	void (*tlm_set_log_filename)(const char *f);
 	void (*tlm_notify_event)(enum tlmu_event ev, void *d);
+	int (*tlm_notify_event_cpu)(int cpu, enum tlmu_event ev, void *d);
+	int (*tlm_current_cpu)(void);
+	void (*tlm_set_irq)(int line, int level);
+	int *tlm_irq_sync;
 	void (**tlm_timer_start)(void *o,
 			void *cb_o, void (*cb)(void *o), int64_t delta);
 	void (**tlm_sync)(void *o, int64_t time_ns);
 	uint64_t *tlm_sync_period_ns;
+	int *tlm_sync_decoupled;
+	uint64_t *tlm_quantum_ns;
+	void **tlm_quantum_opaque;
+	void (**tlm_quantum_barrier)(void *o, int64_t time_ns);
 	int *tlm_boot_state;
+	int *tlm_dmi_tlb;
+	struct tlmu_stats *tlm_stats;
+	int *tlm_prof;
+	int (*tlm_prof_dump)(const char *filename);
+	struct tlmu_cov *tlm_cov;
+	struct tlmu_trace *tlm_trace;
+	void (*tlm_trace_set_mem)(unsigned int sample);
+	uint32_t *tlm_line_size;
+	uint64_t *tlm_tb_size;
+	uint64_t *tlm_tb_size_max;
+	unsigned int *tlm_jmp_cache_bits;
 	int (**tlm_bus_access_cb)(void *o, int64_t clk, int rw,
 				uint64_t addr, void *data, int len);
 	void (**tlm_bus_access_dbg_cb)(void *o, int64_t clk,
 			int rw, uint64_t addr, void *data, int len);
 	int (*tlm_bus_access)(int rw, uint64_t addr, void *data, int len);
+	int (*tlm_bus_access_burst)(int rw, uint64_t addr, void *data, int len);
 	void (*tlm_bus_access_dbg)(int rw,
 				uint64_t addr, void *data, int len);
 
@@ -141,11 +179,124 @@ void tlmu_set_sync_cb(struct tlmu *t, void (*cb)(void *, int64_t));
 #endif
 
 void tlmu_notify_event(struct tlmu *t, enum tlmu_event ev, void *d);
+/*
+ * Like tlmu_notify_event but IRQ, WAKE and SLEEP events go to a specific
+ * core of an SMP machine (-smp N). Other events affect the whole
+ * instance.
+ *
+ * t      - pointer to the TLMu instance
+ * cpu    - core index, 0 to N - 1
+ *
+ * Returns zero on success, non-zero if there is no such core.
+ */
+int tlmu_notify_event_cpu(struct tlmu *t, int cpu,
+			enum tlmu_event ev, void *d);
+/*
+ * Returns the index of the core making the current bus access, for use
+ * from the bus access callbacks of an SMP machine. Returns -1 for
+ * accesses that don't come from a core, e.g from DMA devices.
+ *
+ * t      - pointer to the TLMu instance
+ */
+int tlmu_current_cpu(struct tlmu *t);
+/*
+ * Set the level of a single interrupt line, without the struct tlmu_irq
+ * encoding of TLMU_TLM_EVENT_IRQ.
+ *
+ * t      - pointer to the TLMu instance
+ * line   - interrupt line number
+ * level  - non-zero to raise the line, zero to lower it
+ */
+void tlmu_set_irq(struct tlmu *t, int line, int level);
+/*
+ * Select synchronous interrupt delivery. By default interrupt events get
+ * delivered from a bottom half in the main loop. In synchronous mode they
+ * take effect immediately, or at the next TB boundary if the CPU is in
+ * the middle of a TB.
+ *
+ * t      - pointer to the TLMu instance
+ * v      - non-zero to enable, zero to disable (default).
+ */
+void tlmu_set_irq_sync(struct tlmu *t, int v);
 void tlmu_set_sync_period_ns(struct tlmu *t, uint64_t period_ns);
+/*
+ * Select temporally decoupled syncing. By default TLMu syncs on every
+ * DMI access to areas not mapped as RAM. In decoupled mode, these
+ * accesses only sync once the sync period has passed since the last one.
+ * Syncs at TB exits and at bus access callbacks are not affected.
+ *
+ * t      - pointer to the TLMu instance
+ * v      - non-zero to enable, zero to disable (default).
+ */
+void tlmu_set_sync_decoupled(struct tlmu *t, int v);
 void tlmu_set_boot_state(struct tlmu *t, int v);
+/*
+ * Map granted DMI areas of RAMs registered with tlmu_map_ram straight
+ * into the emulated CPU's TLB. Loads and stores to these areas will then
+ * run at native RAM speed without calling into TLMu. DMI latencies are
+ * not accounted for these accesses. Code fetches and stores to pages
+ * holding translated code still go through the TLM path. DMI regions of
+ * the main TLM bus area are not mapped, accesses to them keep calling
+ * the sync callback as devices may live there.
+ *
+ * t      - pointer to the TLMu instance
+ * v      - non-zero to enable, zero to disable (default).
+ */
+void tlmu_set_dmi_tlb(struct tlmu *t, int v);
+/*
+ * Fetch whole aligned lines of size bytes on read misses to RAMs
+ * registered with tlmu_map_ram that don't allow DMI. The lines are kept
+ * in a small per RAM cache, so later reads to the same line don't call
+ * the bus_access callback. Writes through TLMu and DMI grants,
+ * evictions and invalidations drop the cached lines. The cache only
+ * holds as long as nothing else writes these RAMs, other writers (e.g
+ * other masters in the main emulator) must invalidate DMI for the
+ * written range. Line fills are off while tlmu_set_dmi_tlb is enabled.
+ * The size may be changed while running, lines cached with another size
+ * then get dropped.
+ *
+ * t      - pointer to the TLMu instance
+ * size   - Line size in bytes, a power of 2 up to 256. Zero disables
+ *          line fills (default).
+ */
+void tlmu_set_line_fill_size(struct tlmu *t, uint32_t size);
+/*
+ * Size the buffer holding translated code. Must be called before
+ * tlmu_run. When the buffer fills up, it doubles in place up to max_size
+ * and the translated code is kept. Only a full buffer at max_size gets
+ * flushed. The tb_flushes, tb_grows and translated_bytes counters help
+ * finding the right sizes.
+ *
+ * t        - pointer to the TLMu instance
+ * size     - Initial size in bytes. Zero selects the QEMU default.
+ * max_size - Size in bytes to grow up to. Zero or anything below size
+ *            disables growing (default).
+ */
+void tlmu_set_tb_size(struct tlmu *t, uint64_t size, uint64_t max_size);
+/*
+ * Size the per core cache mapping guest pcs to translated code, looked
+ * up whenever a block doesn't jump straight into the next one. Larger
+ * caches help guests with a lot of code reached through indirect
+ * jumps. Must be called before tlmu_run. The jmp_cache_misses counter
+ * tells how often the cache misses.
+ *
+ * t      - pointer to the TLMu instance
+ * bits   - log2 of the number of entries, clamped to twice the target
+ *          page bits. Zero selects the default of 12.
+ */
+void tlmu_set_jmp_cache_bits(struct tlmu *t, unsigned int bits);
 
 int tlmu_bus_access(struct tlmu *t, int rw,
 		uint64_t addr, void *data, int len);
+/*
+ * Like tlmu_bus_access but for bursts of any length. RAM is accessed with
+ * memcpy and TLM areas get a single bus access callback per contiguous
+ * region, instead of one per word.
+ *
+ * Returns 1 if the accessed unit supports DMI.
+ */
+int tlmu_bus_access_burst(struct tlmu *t, int rw,
+		uint64_t addr, void *data, int len);
 void tlmu_bus_access_dbg(struct tlmu *t,
                         int rw, uint64_t addr, void *data, int len);
 /*
@@ -170,6 +321,61 @@ void tlmu_set_timer_start_cb(struct tlmu *t, void *o,
  */
 void tlmu_map_ram(struct tlmu *t, const char *name,
                 uint64_t addr, uint64_t size, int rw);
+/*
+ * Like tlmu_map_ram but the RAM is backed by host memory owned by the
+ * main emulator, typically the buffer of its memory model. TLMu accesses
+ * it directly at native speed and never issues bus accesses for it.
+ *
+ * addr and size must be multiples of the TLMu target page size and host
+ * must stay valid for as long as the instance runs. For an fd, mmap it
+ * and pass the mapping. Writes made by the main emulator directly into
+ * host memory are not seen by code TLMu already translated, write code
+ * through tlmu_bus_access to keep it coherent.
+ *
+ * t         - The TLMu instance
+ * name      - An name for the RAM
+ * addr      - Base address
+ * size      - Size of RAM
+ * rw        - Zero if ROM, one if writes are allowed.
+ * host      - Host memory holding the RAM contents
+ */
+void tlmu_map_ram_ptr(struct tlmu *t, const char *name,
+                uint64_t addr, uint64_t size, int rw, void *host);
+/*
+ * Save the state of a TLMu instance to a file: CPU and device state,
+ * plus the contents of all RAMs. RAMs mapped with tlmu_map_ram are
+ * read through the bus_access_dbg callback.
+ *
+ * The save happens once the CPUs reach the next TB boundary, before
+ * they execute more guest code. When called from a callback, that is
+ * after the callback returns. Poll tlmu_snapshot_status to know when
+ * the file is complete.
+ *
+ * t         - The TLMu instance
+ * filename  - File to save to
+ *
+ * Returns zero if the save got scheduled, non-zero if another one is
+ * already pending.
+ */
+int tlmu_snapshot_save(struct tlmu *t, const char *filename);
+/*
+ * Returns one while a tlmu_snapshot_save is pending, zero when the last
+ * one completed and a negative value if it failed.
+ *
+ * t         - The TLMu instance
+ */
+int tlmu_snapshot_status(struct tlmu *t);
+/*
+ * Restore a snapshot saved by tlmu_snapshot_save when the instance
+ * starts, instead of booting. Call before tlmu_run with the same setup
+ * (machine, CPU, RAM maps) as the saved instance. The contents of RAMs
+ * mapped with tlmu_map_ram are written back through the bus_access_dbg
+ * callback. Startup fails if the snapshot can't be restored.
+ *
+ * t         - The TLMu instance
+ * filename  - File to restore from
+ */
+void tlmu_snapshot_load(struct tlmu *t, const char *filename);
 /*
  * Set the per TLMu instance log filename.
  *
@@ -177,10 +383,138 @@ void tlmu_map_ram(struct tlmu *t, const char *name,
  * f         - Log filename
  */
 void tlmu_set_log_filename(struct tlmu *t, const char *f);
+/*
+ * Read the performance counters of a TLMu instance. The counters are
+ * cumulative since the instance was loaded. DMI hits and misses count
+ * accesses through the TLM devices, accesses made straight from the TLB
+ * (see tlmu_set_dmi_tlb) are not seen.
+ *
+ * t         - The TLMu instance
+ * stats     - pointer to a tlmu_stats structure to fill out.
+ */
+void tlmu_get_stats(struct tlmu *t, struct tlmu_stats *stats);
+/*
+ * Count executions per translated block. The translated code bumps a
+ * counter at each block entry, so the cost is a few percent. Must be
+ * set before tlmu_run.
+ *
+ * t         - The TLMu instance
+ * v         - non-zero to enable, zero to disable (default).
+ */
+void tlmu_set_tb_prof(struct tlmu *t, int v);
+/*
+ * Write the TB profile collected so far as a binary histogram of guest
+ * code ranges, see struct tlmu_prof_entry. Call it from the instance's
+ * callbacks or after tlmu_run returns.
+ *
+ * t         - The TLMu instance
+ * filename  - Output file
+ *
+ * Returns zero on success.
+ */
+int tlmu_tb_prof_dump(struct tlmu *t, const char *filename);
+/*
+ * Record code coverage into a bitmap with one bit per granule bytes of
+ * guest code, from base to base + size - 1. Bits get set as code gets
+ * translated, so there is no cost at execution time. A granule of the
+ * smallest insn size gives instruction granular coverage. Must be
+ * called before tlmu_run, the emulator reads the setup without locking.
+ *
+ * t         - The TLMu instance
+ * bitmap    - At least ((size - 1) / granule) / 8 + 1 bytes of zeroed
+ *             memory, e.g shared memory. NULL lets TLMu allocate it.
+ * base      - Start of the covered guest code
+ * size      - Size of the covered guest code, up to 4GB
+ * granule   - Bytes per bit, a power of 2
+ *
+ * Returns zero on success, non-zero on bad arguments or if the instance
+ * is running.
+ */
+int tlmu_set_coverage(struct tlmu *t, void *bitmap,
+		uint64_t base, uint64_t size, unsigned int granule);
+/*
+ * Write the coverage bitmap in drcov format, as one module covering the
+ * whole range.
+ *
+ * Returns zero on success.
+ */
+int tlmu_cov_dump(struct tlmu *t, const char *filename);
+/*
+ * Merge the coverage from a drcov file written by tlmu_cov_dump into the
+ * bitmap, e.g to accumulate coverage over several runs.
+ *
+ * Returns zero on success.
+ */
+int tlmu_cov_merge(struct tlmu *t, const char *filename);
+/*
+ * Stream a binary execution trace to filename, one struct tlmu_trace_rec
+ * per executed TB and, see tlmu_trace_set_mem, per guest bus access.
+ * Records go through a lock-free ring that a background thread flushes,
+ * the emulator only stalls if the ring fills up. Call
+ * before tlmu_run, as only code translated after this point gets traced.
+ * scripts/tlmu-trace.py decodes the file.
+ *
+ * t         - The TLMu instance
+ * filename  - The trace file
+ * nr_recs   - Size of the ring in records, a power of 2. Zero selects
+ *             a default.
+ *
+ * Returns zero on success.
+ */
+int tlmu_trace_start(struct tlmu *t, const char *filename,
+		unsigned int nr_recs);
+/*
+ * Select whether the trace gets a record per executed TB. On by default.
+ * Only affects code translated after the call, blocks already translated
+ * keep recording or not until they get flushed.
+ */
+void tlmu_trace_set_exec(struct tlmu *t, int on);
+/*
+ * Add guest bus accesses on TLM areas to the trace, both the ones going
+ * to the bus access callback and the ones served by DMI or the line fill
+ * cache. Direct TLB mappings of DMI regions (tlmu_set_dmi_tlb) are
+ * flushed and held back while sampling so that no access gets missed.
+ * May be called while running, e.g from the instance's callbacks.
+ *
+ * t         - The TLMu instance
+ * sample    - Record one in every sample accesses, 1 records all of
+ *             them. Zero turns it off.
+ */
+void tlmu_trace_set_mem(struct tlmu *t, unsigned int sample);
+/*
+ * Flush and close the execution trace. May be called while the instance
+ * runs, e.g from another thread or from its callbacks. It waits for a
+ * record being written to land, anything traced after that is dropped.
+ * Don't call it concurrently with tlmu_trace_start.
+ *
+ * Returns zero on success.
+ */
+int tlmu_trace_stop(struct tlmu *t);
 void tlmu_set_image_load_params(struct tlmu *t, uint64_t base, uint64_t size);
 
 void tlmu_run(struct tlmu *t);
 void tlmu_exit(struct tlmu *t);
+/*
+ * Run a set of loaded and configured TLMu instances, each on its own
+ * host thread, in lockstep quanta of emulated time. At every quantum
+ * edge all instances stop and the exchange callback gets called from
+ * one of the threads, with the others parked. This is where bus traffic
+ * and interrupts between instances should be passed on. For a fixed
+ * quantum the instances see each others events at the same emulated
+ * times on every run. Requires "-icount".
+ *
+ * t          - array of TLMu instances
+ * n          - number of instances
+ * quantum_ns - quantum length in ns of emulated time
+ * exchange   - called at each quantum edge with the edge time. Return
+ *              non-zero to stop all instances.
+ * o          - opaque passed to exchange
+ *
+ * Returns once all instances have exited. Non-zero if some instances
+ * could not be started.
+ */
+int tlmu_run_parallel(struct tlmu **t, int n, uint64_t quantum_ns,
+		int (*exchange)(void *o, int64_t time_ns), void *o);
 static inline void tlmu_delete(struct tlmu *t)
 {
 	/* FIXME.  */
@@ -40,6 +40,11 @@ target_ulong gen_opc_pc[OPC_BUF_SIZE];
 uint16_t gen_opc_icount[OPC_BUF_SIZE];
 uint8_t gen_opc_instr_start[OPC_BUF_SIZE];
 
+/* Execution counter of the TB being translated, NULL if not profiling.  */
+uint64_t *gen_tb_prof_counter;
+/* TB being translated if its executions get traced, NULL otherwise.  */
+TranslationBlock *gen_tb_trace;
+
 void cpu_gen_init(void)
 {
     tcg_context_init(&tcg_ctx); 
@@ -67,7 +72,11 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
 #endif
     tcg_func_start(s);
 
+    gen_tb_prof_counter = tb->cflags & CF_TLM_PROF ? &tb->prof_count : NULL;
+    gen_tb_trace = tb->cflags & CF_TLM_TRACE ? tb : NULL;
     gen_intermediate_code(env, tb);
+    gen_tb_prof_counter = NULL;
+    gen_tb_trace = NULL;
 
     /* generate machine code */
     gen_code_buf = tb->tc_ptr;
@@ -123,7 +132,12 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     tcg_func_start(s);
 
+    /* Must generate the same code as cpu_gen_code.  */
+    gen_tb_prof_counter = tb->cflags & CF_TLM_PROF ? &tb->prof_count : NULL;
+    gen_tb_trace = tb->cflags & CF_TLM_TRACE ? tb : NULL;
     gen_intermediate_code_pc(env, tb);
+    gen_tb_prof_counter = NULL;
+    gen_tb_trace = NULL;
 
     if (use_icount) {
         /* Reset the cycle counter to the start of the block.  */
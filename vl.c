@@ -162,6 +162,7 @@ int main(int argc, char **argv)
 #include "qemu-queue.h"
 #include "cpus.h"
 #include "arch_init.h"
+#include "tlm.h"
 
 #include "ui/qemu-spice.h"
 
@@ -3437,6 +3438,14 @@ int vl_main(int ignore_sigint, int no_sdl, int no_gui_timer,
             autostart = 0;
         }
     }
+    if (tlm_snapshot_load_file) {
+        if (qemu_loadvm_file(tlm_snapshot_load_file) < 0) {
+            exit(1);
+        }
+        /* Allocated by tlmu_snapshot_load.  */
+        free((void *) tlm_snapshot_load_file);
+        tlm_snapshot_load_file = NULL;
+    }
 
     if (incoming) {
         int ret = qemu_start_incoming_migration(incoming);